@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <functional>
 #include <string>
+#include <utility>
 
 /**
  * @brief Inteface to separate the concerns between the actual MQTT implementation that has a lifecycle, connection
@@ -14,6 +15,9 @@ public:
   // First parameter is topic, second one is the message.
   typedef std::function<void(std::string, std::string)> SubscriptionCallback;
 
+  // Identifies one callback subscribed to a topic, see subscribe() and unsubscribe(). 0 is never a valid handle.
+  typedef uint32_t SubscriptionHandle;
+
   /**
    * @brief Publish a message.
    *
@@ -33,7 +37,7 @@ public:
 
   /**
    * @brief Subscribe to a topic. The callback will be invoked on every new message.
-   * There can only be one callback per topic. If trying to subscribe to an already subscribe topic, it will be ignored.
+   * Several callbacks can subscribe to the same topic, see the implementation for how retained messages are handled.
    * Don't do have operations in the callback or delays as this will block the MQTT callback.
    * If not connected, will subscribe to this topic once connected.
    *
@@ -43,15 +47,48 @@ public:
   virtual bool subscribe(std::string topic, SubscriptionCallback message_callback) = 0;
 
   /**
-   * @brief Unsubscribe a topic.
+   * @brief Same as subscribe() above, but also sets handle to identify this callback, to later remove only this
+   * callback using unsubscribe(topic, handle). Use this when other code might subscribe to the same topic.
+   * handle is set to 0 if the callback was not added.
+   *
+   * The default implementation is for implementations without handles: it uses subscribe() above and sets handle to
+   * 1, so unsubscribe(topic, handle) removes all callbacks for the topic.
+   */
+  virtual bool subscribe(std::string topic, SubscriptionCallback message_callback, SubscriptionHandle &handle) {
+    handle = 1;
+    return subscribe(std::move(topic), std::move(message_callback));
+  }
+
+  /**
+   * @brief Unsubscribe a topic. Removes all callbacks for the topic.
    */
   virtual bool unsubscribe(std::string topic) = 0;
 
+  /**
+   * @brief Remove the callback identified by handle, see subscribe(). The topic is only unsubscribed from once the
+   * last callback for it has been removed.
+   * @return false if there is no such callback, true if other callbacks remain for the topic, otherwise as for
+   * unsubscribe(topic).
+   *
+   * The default implementation is for implementations without handles, and uses unsubscribe(topic).
+   */
+  virtual bool unsubscribe(std::string topic, SubscriptionHandle handle) {
+    return handle != 0 && unsubscribe(std::move(topic));
+  }
+
   /**
    * @brief returns if there is a connection to the MQTT server.
    */
   virtual bool connected() = 0;
 
+  /**
+   * @brief returns the number of times a connection to the MQTT server has been established, to detect a reconnect
+   * that happened between two calls to connected().
+   *
+   * The default implementation is for implementations that don't count connections, and returns 0.
+   */
+  virtual uint32_t connectionCount() { return 0; }
+
   /**
    * @brief The client ID for this device. This is used for the last will / status
    * topic.Example, if this is "esp_now_router", then the status/last will topic will be "esp_now_router/status". This
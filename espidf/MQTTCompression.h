@@ -0,0 +1,38 @@
+#ifndef __MQTT_COMPRESSION_H__
+#define __MQTT_COMPRESSION_H__
+
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief Small LZ77 (LZSS) codec for MQTT payloads, see MQTTRemote::Configuration::compress_min_size.
+ * Made for repetitive text like JSON configs and diagnostic dumps, with low RAM use so that it also works on ESP8266:
+ * the window is 4 KB (the data itself, no copy), and compressing uses a 2 KB hash table on the heap. Decompressing
+ * uses no memory except for the output.
+ *
+ * A compressed payload starts with the two bytes 0xFF 'Z', which cannot start a UTF-8 text or JSON payload,
+ * followed by the uncompressed size (as a varint) and the compressed data. Groups of eight items follow a flag byte
+ * (LSB first), where a 0 bit is a literal byte and a 1 bit is a match of two bytes: 12 bits of offset (1 to 4096) and
+ * 4 bits of length (3 to 18).
+ */
+class MQTTCompression {
+public:
+  /**
+   * @brief Compress data into compressed. Returns false, leaving compressed as is, if the compressed payload would not
+   * be smaller than data.
+   */
+  static bool compress(const std::string &data, std::string &compressed);
+
+  /**
+   * @brief Decompress a payload created by compress() into decompressed. Returns false, leaving decompressed as is, if
+   * data is not a valid compressed payload.
+   */
+  static bool decompress(const std::string &data, std::string &decompressed);
+
+  /**
+   * @brief returns true if data starts with the compressed payload marker.
+   */
+  static bool isCompressed(const std::string &data);
+};
+
+#endif // __MQTT_COMPRESSION_H__
@@ -0,0 +1,119 @@
+#include "MQTTCoroutines.h"
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include <chrono>
+
+#define CONNECTION_POLL_MS 100
+
+bool MQTTCoroutines::PublishAwaiter::await_suspend(std::coroutine_handle<> handle) {
+  // The callback can be invoked from within publishMessage(). Still fine to post, as the flow is resumed later by the
+  // executor.
+  return _coroutines._remote.publishMessage(_topic, _message, _retain, _qos, MQTTRemote::Priority::Normal,
+                                            [this, handle](bool delivered) {
+                                              _delivered = delivered;
+                                              _coroutines.post(handle);
+                                            });
+}
+
+void MQTTCoroutines::MessageAwaiter::await_suspend(std::coroutine_handle<> handle) {
+  _handle = handle;
+  _coroutines.addMessageWaiter(this);
+}
+
+void MQTTCoroutines::run() {
+  while (true) {
+    poll();
+    std::unique_lock<std::mutex> lock(_mutex);
+    _wake.wait_for(lock, std::chrono::milliseconds(CONNECTION_POLL_MS), [this] { return !_ready.empty(); });
+  }
+}
+
+size_t MQTTCoroutines::poll() {
+  size_t resumed = 0;
+  if (!_connection_waiters.empty() && _remote.connected()) {
+    auto waiters = std::move(_connection_waiters);
+    _connection_waiters.clear();
+    for (auto waiter : waiters) {
+      waiter.resume();
+      resumed++;
+    }
+  }
+
+  while (true) {
+    std::coroutine_handle<> handle;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_ready.empty()) {
+        return resumed;
+      }
+      handle = _ready.front();
+      _ready.pop_front();
+    }
+    handle.resume();
+    resumed++;
+  }
+}
+
+void MQTTCoroutines::post(std::coroutine_handle<> handle) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _ready.push_back(handle);
+  }
+  _wake.notify_one();
+}
+
+void MQTTCoroutines::addMessageWaiter(MessageAwaiter *waiter) {
+  bool queued;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto &queue = _queued_messages[waiter->_topic_filter];
+    queued = !queue.empty();
+    if (queued) {
+      waiter->_message = std::move(queue.front());
+      queue.pop_front();
+    } else {
+      _message_waiters[waiter->_topic_filter].push_back(waiter);
+    }
+  }
+  if (queued) {
+    post(waiter->_handle);
+    return;
+  }
+  // After adding the waiter, as the subscription can deliver a (cached retained) message directly.
+  if (_subscribed.insert(waiter->_topic_filter).second) {
+    auto topic_filter = waiter->_topic_filter;
+    _remote.subscribe(topic_filter, [this, topic_filter](const std::string &topic, const std::string &message) {
+      onMessage(topic_filter, topic, message);
+    });
+  }
+}
+
+void MQTTCoroutines::onMessage(const std::string &topic_filter, const std::string &topic,
+                               const std::string &message) {
+  std::vector<MessageAwaiter *> waiters;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _message_waiters.find(topic_filter);
+    if (found == _message_waiters.end() || found->second.empty()) {
+      // Until the next nextMessage().
+      if (_message_queue_size == 0) {
+        return;
+      }
+      auto &queue = _queued_messages[topic_filter];
+      if (queue.size() >= _message_queue_size) {
+        queue.pop_front();
+      }
+      queue.push_back({topic, message});
+      return;
+    }
+    waiters = std::move(found->second);
+    found->second.clear();
+  }
+  for (auto waiter : waiters) {
+    waiter->_message = {topic, message};
+    post(waiter->_handle);
+  }
+}
+
+#endif // __cpp_impl_coroutine
@@ -0,0 +1,200 @@
+#ifndef __MQTT_COROUTINES_H__
+#define __MQTT_COROUTINES_H__
+
+// Requires C++20 (default since ESP-IDF 5.0).
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include "MQTTRemote.h"
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief A coroutine run by MQTTCoroutines. Write a flow as a function returning MQTTFlow and using co_await, and
+ * start it using MQTTCoroutines::spawn().
+ */
+class MQTTFlow {
+public:
+  struct promise_type {
+    MQTTFlow get_return_object() { return MQTTFlow(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    // Started by MQTTCoroutines::spawn(), on the executor.
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    // Frees the coroutine frame when the flow returns.
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  MQTTFlow(MQTTFlow &&other) noexcept : _handle(std::exchange(other._handle, {})) {}
+  MQTTFlow(const MQTTFlow &) = delete;
+  MQTTFlow &operator=(const MQTTFlow &) = delete;
+
+  ~MQTTFlow() {
+    // Never spawned.
+    if (_handle) {
+      _handle.destroy();
+    }
+  }
+
+private:
+  friend class MQTTCoroutines;
+  explicit MQTTFlow(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+
+  std::coroutine_handle<promise_type> _handle;
+};
+
+/**
+ * @brief Coroutine API on top of MQTTRemote, to write sequential flows like "wait for connection, wait for the
+ * retained config, publish the state and wait for the broker to acknowledge it" without callbacks, state machines or
+ * a task per flow.
+ *
+ * All flows run on one task, the one calling run() (or poll()), so a flow only costs its coroutine frame on the heap
+ * and thousands of concurrent flows are fine. Flows resume one at a time, so they do not need any locking between
+ * them, but must not block (no delays or blocking calls, use co_await instead).
+ *
+ * Example:
+ * ```cpp
+ *   MQTTFlow configure(MQTTCoroutines &mqtt) {
+ *     co_await mqtt.connected();
+ *     auto config = co_await mqtt.nextMessage("my_device/config");
+ *     bool delivered = co_await mqtt.publish("my_device/state", "configured: " + config.message, true, 1);
+ *   }
+ *
+ *   MQTTCoroutines mqtt(mqtt_remote);
+ *   mqtt.spawn(configure(mqtt));
+ *   mqtt.run();
+ * ```
+ *
+ * Must live as long as the MQTTRemote, as it subscribes using it.
+ */
+class MQTTCoroutines {
+public:
+  struct Message {
+    std::string topic;
+    std::string message;
+  };
+
+  class ConnectedAwaiter {
+  public:
+    bool await_ready() { return _coroutines._remote.connected(); }
+    void await_suspend(std::coroutine_handle<> handle) { _coroutines._connection_waiters.push_back(handle); }
+    void await_resume() {}
+
+  private:
+    friend class MQTTCoroutines;
+    ConnectedAwaiter(MQTTCoroutines &coroutines) : _coroutines(coroutines) {}
+    MQTTCoroutines &_coroutines;
+  };
+
+  class PublishAwaiter {
+  public:
+    bool await_ready() { return false; }
+    bool await_suspend(std::coroutine_handle<> handle);
+    bool await_resume() { return _delivered; }
+
+  private:
+    friend class MQTTCoroutines;
+    PublishAwaiter(MQTTCoroutines &coroutines, std::string topic, std::string message, bool retain, uint8_t qos)
+        : _coroutines(coroutines), _topic(std::move(topic)), _message(std::move(message)), _retain(retain),
+          _qos(qos) {}
+    MQTTCoroutines &_coroutines;
+    std::string _topic;
+    std::string _message;
+    bool _retain;
+    uint8_t _qos;
+    bool _delivered = false;
+  };
+
+  class MessageAwaiter {
+  public:
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    Message await_resume() { return std::move(_message); }
+
+  private:
+    friend class MQTTCoroutines;
+    MessageAwaiter(MQTTCoroutines &coroutines, std::string topic_filter)
+        : _coroutines(coroutines), _topic_filter(std::move(topic_filter)) {}
+    MQTTCoroutines &_coroutines;
+    std::string _topic_filter;
+    std::coroutine_handle<> _handle;
+    Message _message;
+  };
+
+  /**
+   * @param remote the MQTTRemote to use.
+   * @param message_queue_size maximum number of messages to keep per topic filter while no flow is waiting in
+   * nextMessage(), see nextMessage().
+   */
+  MQTTCoroutines(MQTTRemote &remote, size_t message_queue_size = 8)
+      : _remote(remote), _message_queue_size(message_queue_size) {}
+
+  /**
+   * @brief Start a flow. The flow runs on the next call to run() or poll(). Can be called from any task.
+   */
+  void spawn(MQTTFlow flow) { post(std::exchange(flow._handle, {})); }
+
+  /**
+   * @brief Run flows on the calling task, forever.
+   */
+  void run();
+
+  /**
+   * @brief Run the flows that can run right now on the calling task, without waiting. Use instead of run() to run the
+   * flows from an existing loop. Returns the number of times a flow was resumed.
+   */
+  size_t poll();
+
+  /**
+   * @brief co_await to wait until connected to the MQTT broker. Returns directly if already connected.
+   * The connection state is checked every 100ms.
+   */
+  ConnectedAwaiter connected() { return ConnectedAwaiter(*this); }
+
+  /**
+   * @brief co_await to publish a message and wait until it has been delivered, see MQTTRemote::publishMessage() with
+   * a PublishCallback. For QoS 1 and 2, this is when the broker has acknowledged the message. Returns true if
+   * delivered, false if the message could not be published.
+   */
+  PublishAwaiter publish(std::string topic, std::string message, bool retain = false, uint8_t qos = 0) {
+    return PublishAwaiter(*this, std::move(topic), std::move(message), retain, qos);
+  }
+
+  /**
+   * @brief co_await to wait for the next message on a topic (or topic filter with + and # wildcards). The topic is
+   * subscribed to on first use and stays subscribed. Messages arriving while no flow is waiting for the topic filter
+   * are queued, up to message_queue_size (see the constructor) after which the oldest is dropped, and returned by the
+   * next calls first, so that later calls do not miss messages in between. If several flows wait for the same topic
+   * filter, they all get the message.
+   * Subscribing to an already subscribed topic gives the cached retained value, if using
+   * MQTTRemote::Configuration::retained_cache_size.
+   */
+  MessageAwaiter nextMessage(std::string topic_filter) { return MessageAwaiter(*this, std::move(topic_filter)); }
+
+private:
+  void post(std::coroutine_handle<> handle);
+  void addMessageWaiter(MessageAwaiter *waiter);
+  void onMessage(const std::string &topic_filter, const std::string &topic, const std::string &message);
+
+  MQTTRemote &_remote;
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  std::deque<std::coroutine_handle<>> _ready;
+  std::map<std::string, std::vector<MessageAwaiter *>> _message_waiters;
+  // Messages that arrived while no flow was waiting, by topic filter.
+  std::map<std::string, std::deque<Message>> _queued_messages;
+  size_t _message_queue_size;
+  // Only used from the executor.
+  std::vector<std::coroutine_handle<>> _connection_waiters;
+  std::set<std::string> _subscribed;
+};
+
+#endif // __cpp_impl_coroutine
+#endif // __MQTT_COROUTINES_H__
@@ -1,47 +1,216 @@
 #include "MQTTRemote.h"
 #include <algorithm>
+#include <cerrno>
 #include <esp_err.h>
 #include <esp_log.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <fcntl.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <iterator>
+#include <lwip/netdb.h>
+#include <lwip/sockets.h>
+#include <tuple>
+#include <unistd.h>
+#include <vector>
 
 #define RETRY_CONNECT_WAIT_MS 3000
 
 #define LAST_WILL_MSG "offline"
 
+// Checking if the preferred broker is available again, see Configuration::fallback_brokers.
+#define FAILBACK_CHECK_STACK_SIZE 3072
+#define FAILBACK_CHECK_TASK_PRIORITY 5
+#define FAILBACK_CONNECT_TIMEOUT_S 5
+// Longest the failback check interval is multiplied by after moving back failed, see onBrokerConnectFailed().
+#define FAILBACK_MAX_BACKOFF 64
+
+// Publishing messages from the publish lanes, see Configuration::publish_lane_depth.
+#define PUBLISH_LANE_STACK_SIZE 4096
+
+// How often flush() checks if all messages have left.
+#define FLUSH_POLL_MS 10
+
+// Pings a connection must have survived before trying a longer keep alive interval.
+#define KEEP_ALIVE_PROBE_PINGS 3
+
+// Connections lost while idle in a row before a keep alive interval is considered too long.
+#define KEEP_ALIVE_FAILURES 2
+
+// After this time, a keep alive interval considered too long is tried again, as the network path might have changed.
+#define KEEP_ALIVE_FAILURE_EXPIRY_US (24LL * 60 * 60 * 1000000)
+
+// For how long to look for the echo from the broker of a message delivered locally.
+#define LOCAL_ECHO_TIMEOUT_US 5000000
+
+// What a std::map node adds to the element: color and parent, left and right pointers.
+#define MAP_NODE_OVERHEAD_BYTES (4 * sizeof(void *))
+
+// FNV-1a hash of topic and message.
+static uint32_t hashMessage(const std::string &topic, const std::string &message) {
+  uint32_t hash = 2166136261u;
+  auto add = [&hash](const std::string &data) {
+    for (unsigned char c : data) {
+      hash = (hash ^ c) * 16777619u;
+    }
+  };
+  add(topic);
+  hash = (hash ^ 0xff) * 16777619u;
+  add(message);
+  return hash;
+}
+
+// Escapes value for use in a JSON string.
+static std::string escapeJson(const std::string &value) {
+  static const char *hex = "0123456789abcdef";
+  std::string escaped;
+  escaped.reserve(value.size());
+  for (unsigned char c : value) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+      escaped += c;
+    } else if (c < 0x20) {
+      escaped += "\\u00";
+      escaped += hex[c >> 4];
+      escaped += hex[c & 0xf];
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+#define SHARED_SUBSCRIPTION_PREFIX "$share/"
+
+// Messages for a shared subscription ($share/<group>/<filter>) have the actual topic, so these are matched like a
+// filter with wildcards.
+static bool hasWildcard(const std::string &filter) {
+  return filter.find_first_of("+#") != std::string::npos || filter.rfind(SHARED_SUBSCRIPTION_PREFIX, 0) == 0;
+}
+
+// True if topic matches the MQTT topic filter, which can contain + (single level) and # (multi level) wildcards.
+static bool topicMatchesFilter(const std::string &filter, const std::string &topic) {
+  size_t f = 0;
+  size_t t = 0;
+  if (filter.rfind(SHARED_SUBSCRIPTION_PREFIX, 0) == 0) {
+    // Skip the share name.
+    f = filter.find('/', sizeof(SHARED_SUBSCRIPTION_PREFIX) - 1);
+    if (f == std::string::npos) {
+      return false;
+    }
+    f++;
+  }
+  while (f < filter.length()) {
+    if (filter[f] == '#') {
+      return true;
+    } else if (filter[f] == '+') {
+      while (t < topic.length() && topic[t] != '/') {
+        t++;
+      }
+      f++;
+    } else if (t < topic.length() && filter[f] == topic[t]) {
+      f++;
+      t++;
+    } else {
+      // "a/#" also matches "a".
+      return t == topic.length() && filter.compare(f, std::string::npos, "/#") == 0;
+    }
+  }
+  return t == topic.length();
+}
+
 void MQTTRemote::onMqttEvent(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data) {
   MQTTRemote *_this = static_cast<MQTTRemote *>(handler_args);
   esp_mqtt_event_handle_t event = (esp_mqtt_event_handle_t)event_data;
-  esp_mqtt_client_handle_t client = event->client;
 
   switch ((esp_mqtt_event_id_t)event_id) {
   case MQTT_EVENT_CONNECTED:
     ESP_LOGI(MQTTRemoteLog::TAG, "Connected!");
+    _this->_connection_count++;
     _this->_connected = true;
-    xEventGroupSetBits(_this->_connection_state_changed_event_group, ConnectionState::Connected);
+    _this->onBrokerConnected();
+    {
+      std::lock_guard<std::mutex> lock(_this->_keep_alive_mutex);
+      _this->_last_sent_us = esp_timer_get_time();
+      _this->_connection_pings = 0;
+    }
+
+    if (_this->_topic_alias_manager) {
+      // Aliases are only valid for one connection.
+      std::lock_guard<std::mutex> lock(_this->_topic_alias_mutex);
+      _this->_topic_alias_manager->reset();
+    }
 
     // And publish that we are now online.
-    _this->publishMessageVerbose(_this->_last_will_topic, "online", true);
+    if (!_this->_last_will_topic.empty()) {
+      ESP_LOGI(MQTTRemoteLog::TAG, "Publishing online status on topic '%s'", _this->_last_will_topic.c_str());
+      _this->publishMessage(_this->_last_will_topic, "online", true, 0, Priority::High);
+    }
 
-    // Subscribe to all topics.
-    for (const auto &subscription : _this->_subscriptions) {
-#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
-      esp_mqtt_client_subscribe_single(client, subscription.first.c_str(), 0);
-#else
-      esp_mqtt_client_subscribe(client, subscription.first.c_str(), 0);
-#endif
+    _this->_session_present = event->session_present;
+    {
+      std::vector<std::string> topics;
+      std::vector<std::string> unsubscribed_topics;
+      {
+        std::lock_guard<std::mutex> lock(_this->_subscriptions_mutex);
+        if (_this->_session_present) {
+          // Broker still has our subscriptions, only subscribe to the ones added since, and unsubscribe from the ones
+          // removed since.
+          ESP_LOGI(MQTTRemoteLog::TAG, "Session present, skipping resubscribe.");
+          topics.assign(_this->_pending_subscriptions.begin(), _this->_pending_subscriptions.end());
+          unsubscribed_topics.assign(_this->_pending_unsubscriptions.begin(), _this->_pending_unsubscriptions.end());
+        } else {
+          // Subscribe to all topics.
+          for (const auto &subscription : _this->_subscriptions) {
+            topics.push_back(subscription.first);
+          }
+          for (const auto &subscription : _this->_streaming_subscriptions) {
+            topics.push_back(subscription.first);
+          }
+        }
+        _this->_pending_subscriptions.clear();
+        _this->_pending_unsubscriptions.clear();
+      }
+      for (const auto &topic : unsubscribed_topics) {
+        _this->unsubscribeOnBroker(topic);
+      }
+      for (const auto &topic : topics) {
+        _this->subscribeOnBroker(topic);
+      }
     }
 
+    if (_this->_track_operation_memory && _this->_connect_free_heap != 0) {
+      _this->recordOperationMemory(_this->_connect_memory, _this->_connect_free_heap);
+    }
+    _this->notifyConnectionChange(true);
     break;
 
-  case MQTT_EVENT_DISCONNECTED:
+  case MQTT_EVENT_DISCONNECTED: {
     ESP_LOGW(MQTTRemoteLog::TAG, "Disconnected.");
+    // Not a keep alive failure if disconnected to move back to the preferred broker.
+    if (_this->_connected && !_this->_failback_pending) {
+      _this->onKeepAliveDisconnect();
+    }
     _this->_connected = false;
-    xEventGroupSetBits(_this->_connection_state_changed_event_group, ConnectionState::Disconnected);
+    _this->abortStream();
+    _this->notifyConnectionChange(false);
+    if (_this->applyPendingFailback()) {
+      // After esp_mqtt_client_disconnect(), the client does not reconnect by itself.
+      esp_mqtt_client_reconnect(_this->_mqtt_client);
+    }
     break;
+  }
 
   case MQTT_EVENT_ERROR:
     ESP_LOGE(MQTTRemoteLog::TAG, "MQTT_EVENT_ERROR: %s", strerror(event->error_handle->esp_transport_sock_errno));
+    if (!_this->_connected && event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
+      // The broker might have moved. Resolve again on next attempt, but keep the address as fallback.
+      _this->_broker_address_expiry_us = 0;
+    }
+    if (!_this->_connected) {
+      _this->onBrokerConnectFailed();
+    }
     break;
 
   case MQTT_EVENT_SUBSCRIBED:
@@ -54,27 +223,79 @@ void MQTTRemote::onMqttEvent(void *handler_args, esp_event_base_t base, int32_t
 
   case MQTT_EVENT_PUBLISHED:
     ESP_LOGV(MQTTRemoteLog::TAG, "MQTT_EVENT_PUBLISHED");
+    _this->onPublished(event->msg_id, true);
     break;
 
   case MQTT_EVENT_DATA: {
+    OperationMemoryScope memory_scope(*_this, _this->_dispatch_memory);
+    auto received_us = esp_timer_get_time();
+    // Large messages arrive in several fragments, where only the first one has the topic set.
+    bool first_fragment = event->current_data_offset == 0;
+    if (first_fragment) {
+      std::string topic = std::string(event->topic, event->topic_len);
+      // A new message while still receiving one, so the remaining fragments of that one will never arrive.
+      _this->abortStream();
+      std::lock_guard<std::mutex> lock(_this->_subscriptions_mutex);
+      if (_this->_streaming_subscriptions.count(topic) > 0) {
+        _this->_active_stream_topic = topic;
+      }
+    }
+    if (_this->_active_stream_topic) {
+      _this->onStreamingData(event);
+      break;
+    }
+    if (!first_fragment) {
+      ESP_LOGV(MQTTRemoteLog::TAG, "Ignoring fragment at offset %d", event->current_data_offset);
+      break;
+    }
+
     std::string topic = std::string(event->topic, event->topic_len);
     std::string msg = std::string(event->data, event->data_len);
+    if (_this->_decompress && MQTTCompression::isCompressed(msg)) {
+      std::string decompressed;
+      if (MQTTCompression::decompress(msg, decompressed)) {
+        msg = std::move(decompressed);
+      } else {
+        ESP_LOGW(MQTTRemoteLog::TAG, "Failed to decompress message with topic %s, delivering as is.", topic.c_str());
+      }
+    }
+    if (_this->_local_delivery && !_this->_no_local && _this->isLocalEcho(topic, msg)) {
+      ESP_LOGV(MQTTRemoteLog::TAG, "Ignoring echo of locally delivered message with topic %s", topic.c_str());
+      break;
+    }
+    if (_this->isDuplicate(event, topic, msg)) {
+      ESP_LOGD(MQTTRemoteLog::TAG, "Ignoring redelivered message %d with topic %s", event->msg_id, topic.c_str());
+      _this->_suppressed_duplicates++;
+      break;
+    }
     ESP_LOGV(MQTTRemoteLog::TAG, "Received message with topic %s and payload size %d", topic.c_str(), event->data_len);
-    if (auto subscription = _this->_subscriptions.find(topic); subscription != _this->_subscriptions.end()) {
-      ESP_LOGV(MQTTRemoteLog::TAG, "callback found");
-      subscription->second(topic, msg);
-    } else {
-      ESP_LOGV(MQTTRemoteLog::TAG, "NO callback found");
+    if (_this->_traffic_recorder) {
+      _this->_traffic_recorder({false, received_us, topic, msg});
+    }
+    if (event->data_len == event->total_data_len) {
+      _this->cacheRetainedValue(topic, msg, event->retain);
     }
+    _this->dispatchMessage(topic, msg, received_us);
     break;
   }
 
   case MQTT_EVENT_BEFORE_CONNECT:
     ESP_LOGV(MQTTRemoteLog::TAG, "Trying to connect...");
+    // Events are dispatched on the MQTT task, keep its handle for memoryReport().
+    _this->_mqtt_task = xTaskGetCurrentTaskHandle();
+    _this->_connect_started_us = esp_timer_get_time();
+    if (_this->_track_operation_memory) {
+      _this->_connect_free_heap = esp_get_free_heap_size();
+    }
+    _this->applyPendingFailback();
+    if (_this->_broker_address_ttl_s) {
+      _this->refreshBrokerAddress();
+    }
     break;
 
   case MQTT_EVENT_DELETED:
     ESP_LOGV(MQTTRemoteLog::TAG, "MQTT_EVENT_DELETED");
+    _this->onPublished(event->msg_id, false);
     break;
 
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
@@ -88,107 +309,771 @@ void MQTTRemote::onMqttEvent(void *handler_args, esp_event_base_t base, int32_t
   }
 }
 
+bool MQTTRemote::dispatchMessage(const std::string &topic, const std::string &message, int64_t received_us) {
+  // Topic filter and callback. Copied, so that the lock is not held while calling the callbacks, which might
+  // subscribe, unsubscribe or publish.
+  std::vector<std::pair<std::string, SubscriptionCallback>> callbacks;
+  {
+    std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+    if (auto subscription = _subscriptions.find(topic); subscription != _subscriptions.end()) {
+      for (const auto &callback : subscription->second.callbacks) {
+        callbacks.emplace_back(topic, callback.second);
+      }
+    }
+    if (_wildcard_subscriptions > 0) {
+      for (const auto &subscription : _subscriptions) {
+        if (hasWildcard(subscription.first) && topicMatchesFilter(subscription.first, topic)) {
+          for (const auto &callback : subscription.second.callbacks) {
+            callbacks.emplace_back(subscription.first, callback.second);
+          }
+        }
+      }
+    }
+  }
+
+  for (const auto &callback : callbacks) {
+    auto start_us = esp_timer_get_time();
+    callback.second(topic, message);
+    recordDispatch(callback.first, topic, received_us, start_us, esp_timer_get_time());
+  }
+
+  ESP_LOGV(MQTTRemoteLog::TAG, "%s", !callbacks.empty() ? "callback found" : "NO callback found");
+  return !callbacks.empty();
+}
+
+bool MQTTRemote::isDuplicate(esp_mqtt_event_handle_t event, const std::string &topic, const std::string &message) {
+  if (_received_messages.empty() || event->qos != 1) {
+    return false;
+  }
+  ReceivedMessage received = {(uint16_t)event->msg_id, hashMessage(topic, message)};
+  if (event->dup) {
+    for (const auto &previous : _received_messages) {
+      if (previous.msg_id == received.msg_id && previous.hash == received.hash) {
+        return true;
+      }
+    }
+  }
+  _received_messages[_next_received_message] = received;
+  _next_received_message = (_next_received_message + 1) % _received_messages.size();
+  return false;
+}
+
+MQTTRemote::ReplayStats MQTTRemote::replay(std::string capture, float speed) {
+  ReplayStats stats = {};
+  MQTTCaptureReader reader(std::move(capture));
+  MQTTCaptureRecord record;
+  auto start_us = esp_timer_get_time();
+  while (reader.next(record)) {
+    if (record.published) {
+      continue;
+    }
+    if (speed > 0) {
+      int64_t wait_us = start_us + (int64_t)(record.timestamp_us / speed) - esp_timer_get_time();
+      if (wait_us > 0) {
+        vTaskDelay(pdMS_TO_TICKS(wait_us / 1000));
+      }
+    }
+    dispatchMessage(record.topic, record.message, esp_timer_get_time());
+    stats.messages++;
+  }
+  stats.duration_us = esp_timer_get_time() - start_us;
+  stats.failed = reader.failed();
+  return stats;
+}
+
+void MQTTRemote::rememberLocalDelivery(const std::string &topic, const std::string &message) {
+  std::scoped_lock lock(_local_echoes_mutex);
+  _local_echoes[_next_local_echo] = {hashMessage(topic, message), esp_timer_get_time() + LOCAL_ECHO_TIMEOUT_US};
+  _next_local_echo = (_next_local_echo + 1) % _local_echoes.size();
+}
+
+bool MQTTRemote::isLocalEcho(const std::string &topic, const std::string &message) {
+  auto hash = hashMessage(topic, message);
+  auto now_us = esp_timer_get_time();
+  std::scoped_lock lock(_local_echoes_mutex);
+  for (auto &echo : _local_echoes) {
+    if (echo.expiry_us > now_us && echo.hash == hash) {
+      // Each echo is only expected once.
+      echo.expiry_us = 0;
+      return true;
+    }
+  }
+  return false;
+}
+
+void MQTTRemote::cacheRetainedValue(const std::string &topic, const std::string &message, bool retain) {
+  if (_retained_cache_size == 0) {
+    return;
+  }
+  std::scoped_lock lock(_retained_cache_mutex);
+  auto value = _retained_cache.find(topic);
+
+  // An empty retained message clears the retained message on the broker.
+  if (retain && message.empty()) {
+    if (value != _retained_cache.end()) {
+      _retained_cache_bytes -= topic.size() + value->second.message.size();
+      _retained_cache_lru.erase(value->second.lru);
+      _retained_cache.erase(value);
+    }
+    return;
+  }
+
+  if (value == _retained_cache.end()) {
+    // Only start caching a topic once it has a retained message.
+    if (!retain || topic.size() + message.size() > _retained_cache_size) {
+      return;
+    }
+    _retained_cache_lru.push_front(topic);
+    value = _retained_cache.emplace(topic, RetainedValue{"", _retained_cache_lru.begin()}).first;
+    _retained_cache_bytes += topic.size();
+  } else {
+    _retained_cache_lru.splice(_retained_cache_lru.begin(), _retained_cache_lru, value->second.lru);
+  }
+
+  _retained_cache_bytes -= value->second.message.size();
+  value->second.message = message;
+  _retained_cache_bytes += message.size();
+
+  while (_retained_cache_bytes > _retained_cache_size) {
+    auto evicted = _retained_cache.find(_retained_cache_lru.back());
+    ESP_LOGD(MQTTRemoteLog::TAG, "Evicting retained value for %s", evicted->first.c_str());
+    _retained_cache_bytes -= evicted->first.size() + evicted->second.message.size();
+    _retained_cache_lru.pop_back();
+    _retained_cache.erase(evicted);
+  }
+}
+
+void MQTTRemote::forgetRetainedValues(const std::string &topic_filter) {
+  if (_retained_cache_size == 0) {
+    return;
+  }
+  std::scoped_lock lock(_subscriptions_mutex, _retained_cache_mutex);
+  for (auto value = _retained_cache.begin(); value != _retained_cache.end();) {
+    bool matches = value->first == topic_filter || topicMatchesFilter(topic_filter, value->first);
+    // No longer updated by the broker, unless still covered by another subscription.
+    bool still_subscribed = _subscriptions.count(value->first) > 0;
+    for (auto subscription = _subscriptions.begin(); !still_subscribed && subscription != _subscriptions.end();
+         ++subscription) {
+      still_subscribed = hasWildcard(subscription->first) && topicMatchesFilter(subscription->first, value->first);
+    }
+    if (matches && !still_subscribed) {
+      _retained_cache_bytes -= value->first.size() + value->second.message.size();
+      _retained_cache_lru.erase(value->second.lru);
+      value = _retained_cache.erase(value);
+    } else {
+      ++value;
+    }
+  }
+}
+
+void MQTTRemote::recordDispatch(const std::string &topic_filter, const std::string &topic, int64_t received_us,
+                                int64_t start_us, int64_t end_us) {
+  uint32_t duration_us = end_us - start_us;
+  bool slow = _slow_handler_threshold_us && duration_us > *_slow_handler_threshold_us;
+  if (slow) {
+    ESP_LOGW(MQTTRemoteLog::TAG, "Slow callback for %s: %lu us for topic %s", topic_filter.c_str(),
+             (unsigned long)duration_us, topic.c_str());
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+    // The callback might have unsubscribed.
+    if (auto subscription = _subscriptions.find(topic_filter); subscription != _subscriptions.end()) {
+      auto &stats = subscription->second.stats;
+      stats.count++;
+      stats.slow += slow ? 1 : 0;
+      stats.max_us = std::max(stats.max_us, duration_us);
+      stats.total_us += duration_us;
+      size_t bucket = 0;
+      while (bucket < stats.histogram.size() - 1 && (1u << bucket) <= duration_us) {
+        bucket++;
+      }
+      stats.histogram[bucket]++;
+    }
+  }
+
+  if (_dispatch_trace) {
+    _dispatch_trace({topic_filter, topic, received_us, start_us, end_us});
+  }
+}
+
+MQTTRemote::DispatchStats MQTTRemote::dispatchStats(const std::string &topic_filter) {
+  std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+  if (auto subscription = _subscriptions.find(topic_filter); subscription != _subscriptions.end()) {
+    return subscription->second.stats;
+  }
+  return {};
+}
+
+std::string MQTTRemote::toChromeTraceEvent(const DispatchTrace &trace) {
+  return "{\"name\":\"" + escapeJson(trace.topic_filter) + "\",\"cat\":\"dispatch\",\"ph\":\"X\",\"ts\":" +
+         std::to_string(trace.start_us) + ",\"dur\":" + std::to_string(trace.end_us - trace.start_us) +
+         ",\"pid\":0,\"tid\":0,\"args\":{\"topic\":\"" + escapeJson(trace.topic) +
+         "\",\"queued_us\":" + std::to_string(trace.start_us - trace.received_us) + "}}";
+}
+
+void MQTTRemote::onStreamingData(esp_mqtt_event_handle_t event) {
+  StreamingCallbacks callbacks;
+  {
+    std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+    auto subscription = _streaming_subscriptions.find(*_active_stream_topic);
+    if (subscription == _streaming_subscriptions.end()) {
+      // Unsubscribed while receiving, drop the remaining fragments.
+      ESP_LOGV(MQTTRemoteLog::TAG, "Streaming subscription gone, dropping fragment");
+      _active_stream_topic.reset();
+      return;
+    }
+    // Copied, as the callbacks might unsubscribe.
+    callbacks = subscription->second;
+  }
+  if (event->current_data_offset == 0) {
+    ESP_LOGV(MQTTRemoteLog::TAG, "Receiving streamed message with topic %s and total size %d",
+             _active_stream_topic->c_str(), event->total_data_len);
+    if (callbacks.on_begin) {
+      callbacks.on_begin(*_active_stream_topic, event->total_data_len);
+    }
+  }
+
+  if (callbacks.on_chunk && event->data_len > 0) {
+    callbacks.on_chunk(event->current_data_offset, event->data, event->data_len);
+  }
+
+  if (event->current_data_offset + event->data_len >= event->total_data_len) {
+    if (callbacks.on_end) {
+      callbacks.on_end();
+    }
+    _active_stream_topic.reset();
+  }
+}
+
+void MQTTRemote::abortStream() {
+  if (!_active_stream_topic) {
+    return;
+  }
+  ESP_LOGW(MQTTRemoteLog::TAG, "Streamed message with topic %s was interrupted", _active_stream_topic->c_str());
+  std::function<void()> on_abort;
+  {
+    std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+    if (auto subscription = _streaming_subscriptions.find(*_active_stream_topic);
+        subscription != _streaming_subscriptions.end()) {
+      on_abort = subscription->second.on_abort;
+    }
+  }
+  _active_stream_topic.reset();
+  if (on_abort) {
+    on_abort();
+  }
+}
+
 MQTTRemote::MQTTRemote(std::string client_id, std::string host, int port, std::string username, std::string password,
                        Configuration configuration)
-    : _client_id(client_id), _last_will_topic(_client_id + "/status") {
+    : _enqueue_publish(configuration.enqueue_publish), _client_id(client_id),
+      _subscription_qos(configuration.subscription_qos), _received_messages(configuration.duplicate_window),
+      _last_will_topic(configuration.status_topic.value_or(_client_id + "/status")),
+      _failover_after_failures(configuration.failover_after_failures),
+      _failback_check_interval_s(configuration.failback_check_interval_s),
+      _keep_alive_s(configuration.keep_alive_s), _keep_alive_max_s(configuration.keep_alive_max_s),
+      _keep_alive_working_s(configuration.keep_alive_s), _username(username), _password(password),
+      _broker_address_ttl_s(configuration.broker_address_ttl_s),
+      _store_broker_address(configuration.store_broker_address),
+      _publish_lane_depth(configuration.publish_lane_depth),
+      _publish_lane_max_skips(configuration.publish_lane_max_skips),
+      _publish_lane_task_priority(configuration.publish_lane_task_priority),
+      _slow_handler_threshold_us(configuration.slow_handler_threshold_us),
+      _dispatch_trace(configuration.dispatch_trace), _traffic_recorder(configuration.traffic_recorder),
+      _retained_cache_size(configuration.retained_cache_size),
+      _local_delivery(configuration.local_delivery), _forward_local_delivery(configuration.forward_local_delivery),
+      _compress_min_size(configuration.compress_min_size),
+      _compress_topic_prefixes(configuration.compress_topic_prefixes), _decompress(configuration.decompress),
+      _track_operation_memory(configuration.track_operation_memory) {
+
+  _brokers.push_back(parseBroker(host, port, configuration.transport, configuration.verification));
+  for (const auto &broker : configuration.fallback_brokers) {
+    _brokers.push_back(parseBroker(broker.host, broker.port, broker.transport, broker.verification));
+  }
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+  _mqtt_cfg.buffer.size = configuration.rx_buffer_size;
+  _mqtt_cfg.buffer.out_size = configuration.tx_buffer_size;
+
+  _mqtt_cfg.credentials.username = _username.c_str();
+  _mqtt_cfg.credentials.client_id = _client_id.c_str();
+  _mqtt_cfg.credentials.authentication.password = _password.c_str();
 
-  esp_mqtt_client_config_t mqtt_cfg = {};
+  _mqtt_cfg.network.reconnect_timeout_ms = RETRY_CONNECT_WAIT_MS;
+  _mqtt_cfg.network.disable_auto_reconnect = false;
+
+  _mqtt_cfg.session.disable_clean_session = !configuration.clean_session;
+  _mqtt_cfg.session.keepalive = configuration.keep_alive_s;
+  _mqtt_cfg.session.disable_keepalive = false;
+
+  if (!_last_will_topic.empty()) {
+    _mqtt_cfg.session.last_will.topic = _last_will_topic.c_str();
+    _mqtt_cfg.session.last_will.msg = LAST_WILL_MSG;
+    _mqtt_cfg.session.last_will.qos = 0;
+    _mqtt_cfg.session.last_will.retain = 0;
+  }
 
-  esp_mqtt_transport_t transport = MQTT_TRANSPORT_OVER_TCP;
-  if (configuration.transport) {
-    transport = *configuration.transport;
+  if (configuration.task_size) {
+    _mqtt_cfg.task.stack_size = *configuration.task_size;
+  }
+
+  if (configuration.protocol_version) {
+    _mqtt_cfg.session.protocol_ver = *configuration.protocol_version;
+  }
+#else
+  _mqtt_cfg.buffer_size = configuration.rx_buffer_size;
+  _mqtt_cfg.out_buffer_size = configuration.tx_buffer_size;
+
+  _mqtt_cfg.username = _username.c_str();
+  _mqtt_cfg.client_id = _client_id.c_str();
+  _mqtt_cfg.password = _password.c_str();
+
+  _mqtt_cfg.reconnect_timeout_ms = RETRY_CONNECT_WAIT_MS;
+  _mqtt_cfg.disable_auto_reconnect = false;
+
+  _mqtt_cfg.disable_clean_session = !configuration.clean_session;
+  _mqtt_cfg.keepalive = configuration.keep_alive_s;
+  _mqtt_cfg.disable_keepalive = false;
+
+  if (!_last_will_topic.empty()) {
+    _mqtt_cfg.lwt_topic = _last_will_topic.c_str();
+    _mqtt_cfg.lwt_msg = LAST_WILL_MSG;
+    _mqtt_cfg.lwt_msg_len = sizeof(LAST_WILL_MSG) - 1;
+    _mqtt_cfg.lwt_qos = 0;
+    _mqtt_cfg.lwt_retain = 0;
+  }
+
+  if (configuration.task_size) {
+    _mqtt_cfg.task_stack = *configuration.task_size;
+  }
+
+  if (configuration.protocol_version) {
+    _mqtt_cfg.protocol_ver = *configuration.protocol_version;
+  }
+
+  if (_broker_address_ttl_s) {
+    ESP_LOGW(MQTTRemoteLog::TAG, "Broker address caching requires ESP-IDF 5+, ignoring.");
+    _broker_address_ttl_s.reset();
+  }
+#endif
+
+  applyBroker(0);
+
+  if (_broker_address_ttl_s && configuration.load_broker_address) {
+    // A previously stored address is considered fresh for one TTL from now.
+    if (auto address = configuration.load_broker_address(); address && !address->empty()) {
+      ESP_LOGI(MQTTRemoteLog::TAG, "Using stored broker address %s", address->c_str());
+      _broker_address = *address;
+      _broker_address_expiry_us = esp_timer_get_time() + (int64_t)*_broker_address_ttl_s * 1000000;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+      _mqtt_cfg.broker.address.hostname = _broker_address.c_str();
+#endif
+    }
+  }
+
+  _mqtt_client = esp_mqtt_client_init(&_mqtt_cfg);
+
+#ifdef MQTT_REMOTE_PROTOCOL_5
+  if (configuration.protocol_version == MQTT_PROTOCOL_V_5) {
+    esp_mqtt5_connection_property_config_t connect_property = {};
+    connect_property.topic_alias_maximum = configuration.topic_alias_maximum;
+    if (!configuration.clean_session) {
+      connect_property.session_expiry_interval = configuration.session_expiry_interval_s;
+    }
+    ESP_ERROR_CHECK(esp_mqtt5_client_set_connect_property(_mqtt_client, &connect_property));
+    if (configuration.topic_alias_maximum > 0) {
+      _topic_alias_manager.emplace(configuration.topic_alias_maximum);
+    }
+    _no_local = _local_delivery;
+  }
+#else
+  if (configuration.topic_alias_maximum > 0) {
+    ESP_LOGW(MQTTRemoteLog::TAG, "Topic aliases require MQTT 5 (CONFIG_MQTT_PROTOCOL_5), ignoring.");
+  }
+#endif
+}
+
+void MQTTRemote::refreshBrokerAddress() {
+  auto now = esp_timer_get_time();
+  if (!_broker_address.empty() && now < _broker_address_expiry_us) {
+    return;
+  }
+
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *result = nullptr;
+  char address[INET6_ADDRSTRLEN] = {};
+  bool resolved = false;
+  if (getaddrinfo(_host.c_str(), nullptr, &hints, &result) == 0 && result != nullptr) {
+    if (result->ai_family == AF_INET) {
+      resolved = inet_ntop(AF_INET, &((struct sockaddr_in *)result->ai_addr)->sin_addr, address, sizeof(address));
+    } else if (result->ai_family == AF_INET6) {
+      resolved = inet_ntop(AF_INET6, &((struct sockaddr_in6 *)result->ai_addr)->sin6_addr, address, sizeof(address));
+    }
+  }
+  if (result != nullptr) {
+    freeaddrinfo(result);
+  }
+
+  if (!resolved) {
+    if (_broker_address.empty()) {
+      ESP_LOGW(MQTTRemoteLog::TAG, "Failed to resolve %s and no previous address.", _host.c_str());
+    } else {
+      ESP_LOGW(MQTTRemoteLog::TAG, "Failed to resolve %s, using previous address %s.", _host.c_str(),
+               _broker_address.c_str());
+    }
+    return;
+  }
+
+  _broker_address_expiry_us = now + (int64_t)*_broker_address_ttl_s * 1000000;
+  if (_broker_address != address) {
+    ESP_LOGI(MQTTRemoteLog::TAG, "Resolved %s to %s", _host.c_str(), address);
+    _broker_address = address;
+    applyBrokerAddress();
+    // Only the address of the preferred broker is stored, as that is the one loaded on boot.
+    if (_store_broker_address && _active_broker == 0) {
+      _store_broker_address(_broker_address);
+    }
+  }
+}
+
+MQTTRemote::BrokerState MQTTRemote::parseBroker(std::string host, int port,
+                                                std::optional<esp_mqtt_transport_t> transport,
+                                                const Configuration::verification_t &verification) {
+  BrokerState broker = {};
+  broker.port = port;
+  broker.verification = verification;
+  broker.transport = MQTT_TRANSPORT_OVER_TCP;
+  if (transport) {
+    broker.transport = *transport;
   } else {
     // try to deduce from schema.
     std::transform(host.begin(), host.end(), host.begin(), ::tolower);
     if (host.rfind("mqtt://", 0) == 0) {
-      transport = MQTT_TRANSPORT_OVER_TCP;
+      broker.transport = MQTT_TRANSPORT_OVER_TCP;
       host = host.substr(7);
     } else if (host.rfind("mqtts://", 0) == 0) {
-      transport = MQTT_TRANSPORT_OVER_SSL;
+      broker.transport = MQTT_TRANSPORT_OVER_SSL;
       host = host.substr(8);
     } else if (host.rfind("ws://", 0) == 0) {
-      transport = MQTT_TRANSPORT_OVER_WS;
+      broker.transport = MQTT_TRANSPORT_OVER_WS;
       host = host.substr(5);
     } else if (host.rfind("wss://", 0) == 0) {
-      transport = MQTT_TRANSPORT_OVER_WSS;
+      broker.transport = MQTT_TRANSPORT_OVER_WSS;
       host = host.substr(6);
     }
   }
+  broker.host = host;
+  return broker;
+}
+
+void MQTTRemote::applyBroker(size_t index) {
+  const auto &broker = _brokers[index];
+  _active_broker = index;
+  _active_broker_failures = 0;
+  _host = broker.host;
+  // Any resolved address is for the previous broker.
+  _broker_address.clear();
+  _broker_address_expiry_us = 0;
+  bool tls = broker.transport == MQTT_TRANSPORT_OVER_SSL || broker.transport == MQTT_TRANSPORT_OVER_WSS;
 
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
-  mqtt_cfg.broker.address.hostname = host.c_str();
-  mqtt_cfg.broker.address.transport = transport;
-  if (transport == MQTT_TRANSPORT_OVER_SSL || transport == MQTT_TRANSPORT_OVER_WSS) {
-    memcpy(&mqtt_cfg.broker.verification, &configuration.verification, sizeof(configuration.verification));
+  _mqtt_cfg.broker.address.hostname = _host.c_str();
+  _mqtt_cfg.broker.address.transport = broker.transport;
+  _mqtt_cfg.broker.address.port = broker.port;
+  _mqtt_cfg.broker.verification = {};
+  if (tls) {
+    memcpy(&_mqtt_cfg.broker.verification, &broker.verification, sizeof(broker.verification));
     ESP_LOGI(MQTTRemoteLog::TAG, "Using TLS verification");
-    ESP_LOGI(MQTTRemoteLog::TAG, " -- use_global_ca_store: %d", mqtt_cfg.broker.verification.use_global_ca_store);
+    ESP_LOGI(MQTTRemoteLog::TAG, " -- use_global_ca_store: %d", _mqtt_cfg.broker.verification.use_global_ca_store);
     ESP_LOGI(MQTTRemoteLog::TAG, " -- skip_cert_common_name_check: %d",
-             mqtt_cfg.broker.verification.skip_cert_common_name_check);
+             _mqtt_cfg.broker.verification.skip_cert_common_name_check);
+    if (_broker_address_ttl_s && !_mqtt_cfg.broker.verification.common_name) {
+      // We will connect using the resolved address, but the certificate is for the hostname.
+      _mqtt_cfg.broker.verification.common_name = _host.c_str();
+    }
+  }
+#else
+  _mqtt_cfg.host = _host.c_str();
+  _mqtt_cfg.transport = broker.transport;
+  _mqtt_cfg.port = broker.port;
+  _mqtt_cfg.use_global_ca_store = tls && broker.verification.use_global_ca_store;
+  _mqtt_cfg.cert_pem = tls ? broker.verification.certificate : nullptr;
+  _mqtt_cfg.cert_len = tls ? broker.verification.certificate_len : 0;
+  _mqtt_cfg.skip_cert_common_name_check = tls && broker.verification.skip_cert_common_name_check;
+  _mqtt_cfg.psk_hint_key = tls ? broker.verification.psk_hint_key : nullptr;
+  _mqtt_cfg.alpn_protos = tls ? broker.verification.alpn_protos : nullptr;
+  if (tls) {
+    ESP_LOGI(MQTTRemoteLog::TAG, "Using TLS verification");
+    ESP_LOGI(MQTTRemoteLog::TAG, " -- use_global_ca_store: %d", _mqtt_cfg.use_global_ca_store);
+    ESP_LOGI(MQTTRemoteLog::TAG, " -- skip_cert_common_name_check: %d", _mqtt_cfg.skip_cert_common_name_check);
   }
-  mqtt_cfg.broker.address.port = port;
+#endif
+}
 
-  mqtt_cfg.buffer.size = configuration.rx_buffer_size;
-  mqtt_cfg.buffer.out_size = configuration.tx_buffer_size;
+void MQTTRemote::onBrokerConnected() {
+  std::lock_guard<std::mutex> lock(_brokers_mutex);
+  auto &broker = _brokers[_active_broker];
+  broker.connects++;
+  broker.consecutive_failures = 0;
+  _active_broker_failures = 0;
+  if (_active_broker == 0) {
+    _failback_attempted = false;
+    _failback_backoff = 1;
+  }
+  if (_connect_started_us > 0) {
+    broker.connect_latency_us = esp_timer_get_time() - _connect_started_us;
+  }
+  if (_brokers.size() > 1) {
+    ESP_LOGI(MQTTRemoteLog::TAG, "Connected to broker %s:%d in %lu us", broker.host.c_str(), broker.port,
+             (unsigned long)broker.connect_latency_us);
+  }
+}
 
-  mqtt_cfg.credentials.username = username.c_str();
-  mqtt_cfg.credentials.client_id = client_id.c_str();
-  mqtt_cfg.credentials.authentication.password = password.c_str();
+void MQTTRemote::onBrokerConnectFailed() {
+  std::lock_guard<std::mutex> lock(_brokers_mutex);
+  auto &broker = _brokers[_active_broker];
+  broker.failures++;
+  broker.consecutive_failures++;
+  _active_broker_failures++;
+  // After moving back to the preferred broker, a single failure is enough to return to the working fallback broker.
+  if (_brokers.size() < 2 || (!_failback_attempted && _active_broker_failures < _failover_after_failures)) {
+    return;
+  }
+  if (_failback_attempted) {
+    // The preferred broker accepts TCP connections, but not MQTT ones (like rejected credentials or overloaded), so
+    // wait longer each time before moving back again.
+    _failback_attempted = false;
+    _failback_backoff = std::min(_failback_backoff * 2, (uint32_t)FAILBACK_MAX_BACKOFF);
+    _next_failback_check_us = esp_timer_get_time() + (int64_t)_failback_check_interval_s * _failback_backoff * 1000000;
+    ESP_LOGW(MQTTRemoteLog::TAG, "Moving back to %s:%d failed, checking again in %lu s.", broker.host.c_str(),
+             broker.port, (unsigned long)_failback_check_interval_s * _failback_backoff);
+  }
 
-  mqtt_cfg.network.reconnect_timeout_ms = RETRY_CONNECT_WAIT_MS;
-  mqtt_cfg.network.disable_auto_reconnect = false;
+  // Fewest failures in a row first, then lowest latency. Brokers not yet tried have no latency, so are tried first.
+  auto rank = [this](size_t index) {
+    return std::make_tuple(_brokers[index].consecutive_failures, _brokers[index].connect_latency_us, index);
+  };
+  std::optional<size_t> next;
+  for (size_t i = 0; i < _brokers.size(); ++i) {
+    if (i != _active_broker && (!next || rank(i) < rank(*next))) {
+      next = i;
+    }
+  }
+  ESP_LOGW(MQTTRemoteLog::TAG, "Failed to connect to %s:%d %lu times, failing over to %s:%d", broker.host.c_str(),
+           broker.port, (unsigned long)broker.consecutive_failures, _brokers[*next].host.c_str(),
+           _brokers[*next].port);
+  applyBroker(*next);
+  // Called on the MQTT task, the client picks up the new broker on the next connection attempt.
+  esp_mqtt_set_config(_mqtt_client, &_mqtt_cfg);
+}
 
-  mqtt_cfg.session.keepalive = configuration.keep_alive_s;
-  mqtt_cfg.session.disable_keepalive = false;
+bool MQTTRemote::applyPendingFailback() {
+  if (!_failback_pending.exchange(false)) {
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(_brokers_mutex);
+    applyBroker(0);
+    _failback_attempted = true;
+  }
+  esp_mqtt_set_config(_mqtt_client, &_mqtt_cfg);
+  return true;
+}
 
-  mqtt_cfg.session.last_will.topic = _last_will_topic.c_str();
-  mqtt_cfg.session.last_will.msg = LAST_WILL_MSG;
-  mqtt_cfg.session.last_will.qos = 0;
-  mqtt_cfg.session.last_will.retain = 0;
+void MQTTRemote::onFailbackTimer(void *arg) {
+  MQTTRemote *_this = static_cast<MQTTRemote *>(arg);
+  {
+    std::lock_guard<std::mutex> lock(_this->_brokers_mutex);
+    if (_this->_active_broker == 0 || _this->_stopped || esp_timer_get_time() < _this->_next_failback_check_us) {
+      return;
+    }
+  }
+  // The check blocks while connecting, so run it on its own task rather than the timer task.
+  if (_this->_failback_check_running.exchange(true)) {
+    return;
+  }
+  if (xTaskCreate(failbackCheckTask, "mqtt_failback", FAILBACK_CHECK_STACK_SIZE, _this, FAILBACK_CHECK_TASK_PRIORITY,
+                  nullptr) != pdPASS) {
+    ESP_LOGW(MQTTRemoteLog::TAG, "Failed to create task for checking the preferred broker.");
+    _this->_failback_check_running = false;
+  }
+}
 
-  if (configuration.task_size) {
-    mqtt_cfg.task.stack_size = *configuration.task_size;
+void MQTTRemote::failbackCheckTask(void *arg) {
+  MQTTRemote *_this = static_cast<MQTTRemote *>(arg);
+  if (_this->_stopped) {
+    _this->_failback_check_running = false;
+    vTaskDelete(nullptr);
+    return;
   }
-#else
-  mqtt_cfg.host = host.c_str();
-  mqtt_cfg.transport = transport;
-  if (transport == MQTT_TRANSPORT_OVER_SSL || transport == MQTT_TRANSPORT_OVER_WSS) {
-    mqtt_cfg.use_global_ca_store = configuration.verification.use_global_ca_store;
-    mqtt_cfg.cert_pem = configuration.verification.certificate;
-    mqtt_cfg.cert_len = configuration.verification.certificate_len;
-    mqtt_cfg.skip_cert_common_name_check = configuration.verification.skip_cert_common_name_check;
-    mqtt_cfg.psk_hint_key = configuration.verification.psk_hint_key;
-    mqtt_cfg.alpn_protos = configuration.verification.alpn_protos;
-    ESP_LOGI(MQTTRemoteLog::TAG, "Using TLS verification");
-    ESP_LOGI(MQTTRemoteLog::TAG, " -- use_global_ca_store: %d", mqtt_cfg.use_global_ca_store);
-    ESP_LOGI(MQTTRemoteLog::TAG, " -- skip_cert_common_name_check: %d", mqtt_cfg.skip_cert_common_name_check);
+  std::string host;
+  int port;
+  {
+    std::lock_guard<std::mutex> lock(_this->_brokers_mutex);
+    host = _this->_brokers[0].host;
+    port = _this->_brokers[0].port;
   }
-  mqtt_cfg.port = port;
 
-  mqtt_cfg.buffer_size = configuration.rx_buffer_size;
-  mqtt_cfg.out_buffer_size = configuration.tx_buffer_size;
+  auto latency_us = probeBroker(host, port);
+  if (latency_us && !_this->_stopped) {
+    ESP_LOGI(MQTTRemoteLog::TAG, "Preferred broker %s:%d is available again, moving back.", host.c_str(), port);
+    {
+      std::lock_guard<std::mutex> lock(_this->_brokers_mutex);
+      _this->_brokers[0].connect_latency_us = *latency_us;
+    }
+    // The switch is done by the MQTT task, see applyPendingFailback(), either when disconnected or before the next
+    // connection attempt.
+    _this->_failback_pending = true;
+    if (_this->_connected) {
+      esp_mqtt_client_disconnect(_this->_mqtt_client);
+    }
+  }
 
-  mqtt_cfg.username = username.c_str();
-  mqtt_cfg.client_id = client_id.c_str();
-  mqtt_cfg.password = password.c_str();
+  _this->_failback_check_running = false;
+  vTaskDelete(nullptr);
+}
 
-  mqtt_cfg.reconnect_timeout_ms = RETRY_CONNECT_WAIT_MS;
-  mqtt_cfg.disable_auto_reconnect = false;
+std::optional<uint32_t> MQTTRemote::probeBroker(const std::string &host, int port) {
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *result = nullptr;
+  auto service = std::to_string(port);
+  if (getaddrinfo(host.c_str(), service.c_str(), &hints, &result) != 0 || result == nullptr) {
+    if (result != nullptr) {
+      freeaddrinfo(result);
+    }
+    return std::nullopt;
+  }
 
-  mqtt_cfg.keepalive = configuration.keep_alive_s;
-  mqtt_cfg.disable_keepalive = false;
+  std::optional<uint32_t> latency_us;
+  int sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+  if (sock >= 0) {
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    auto start_us = esp_timer_get_time();
+    if (connect(sock, result->ai_addr, result->ai_addrlen) == 0) {
+      latency_us = esp_timer_get_time() - start_us;
+    } else if (errno == EINPROGRESS) {
+      fd_set writable;
+      FD_ZERO(&writable);
+      FD_SET(sock, &writable);
+      struct timeval timeout = {FAILBACK_CONNECT_TIMEOUT_S, 0};
+      int error = 0;
+      socklen_t error_size = sizeof(error);
+      if (select(sock + 1, nullptr, &writable, nullptr, &timeout) > 0 &&
+          getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &error_size) == 0 && error == 0) {
+        latency_us = esp_timer_get_time() - start_us;
+      }
+    }
+    close(sock);
+  }
+  freeaddrinfo(result);
+  return latency_us;
+}
 
-  mqtt_cfg.lwt_topic = _last_will_topic.c_str();
-  mqtt_cfg.lwt_msg = LAST_WILL_MSG;
-  mqtt_cfg.lwt_msg_len = sizeof(LAST_WILL_MSG) - 1;
-  mqtt_cfg.lwt_qos = 0;
-  mqtt_cfg.lwt_retain = 0;
+std::vector<MQTTRemote::BrokerStats> MQTTRemote::brokerStats() {
+  std::lock_guard<std::mutex> lock(_brokers_mutex);
+  std::vector<BrokerStats> stats;
+  for (size_t i = 0; i < _brokers.size(); ++i) {
+    const auto &broker = _brokers[i];
+    stats.push_back({broker.host, broker.port, i == _active_broker, broker.connects, broker.failures,
+                     broker.consecutive_failures, broker.connect_latency_us});
+  }
+  return stats;
+}
 
-  if (configuration.task_size) {
-    mqtt_cfg.task_stack = *configuration.task_size;
+void MQTTRemote::onMessageSent() {
+  std::lock_guard<std::mutex> lock(_keep_alive_mutex);
+  auto now_us = esp_timer_get_time();
+  auto pings = pendingPings(now_us);
+  _pings += pings;
+  _connection_pings += pings;
+  _last_sent_us = now_us;
+}
+
+void MQTTRemote::onKeepAliveDisconnect() {
+  std::lock_guard<std::mutex> lock(_keep_alive_mutex);
+  auto now_us = esp_timer_get_time();
+  auto idle_pings = pendingPings(now_us);
+  _pings += idle_pings;
+  auto connection_pings = _connection_pings;
+  _connection_pings = 0;
+  expireKeepAliveFailure(now_us);
+  if (_keep_alive_max_s <= _keep_alive_working_s && _keep_alive_s == _keep_alive_working_s) {
+    // Not adaptive, or already using the longest interval.
+    return;
+  }
+
+  auto previous_s = _keep_alive_s;
+  if (idle_pings == 0 && connection_pings >= KEEP_ALIVE_PROBE_PINGS) {
+    // Survived enough idle pings, and lost for another reason than being idle, so try a longer interval. A connection
+    // is never dropped just to try one, as reconnecting costs a TLS handshake, lost messages and resubscribing.
+    _keep_alive_idle_failures = 0;
+    _keep_alive_working_s = std::max(_keep_alive_working_s, _keep_alive_s);
+    _keep_alive_s = nextKeepAlive(_keep_alive_working_s);
+  } else if (idle_pings > 0 && _keep_alive_s > _keep_alive_working_s &&
+             ++_keep_alive_idle_failures >= KEEP_ALIVE_FAILURES) {
+    // Lost while idle after a ping several times in a row, likely dropped by a NAT router or the broker, so the
+    // interval is too long. A single loss might as well be a WiFi glitch, so the interval is tried again until then.
+    _keep_alive_idle_failures = 0;
+    _keep_alive_failed_s = _keep_alive_failed_s ? std::min(_keep_alive_failed_s, _keep_alive_s) : _keep_alive_s;
+    _keep_alive_failed_at_us = now_us;
+    _keep_alive_s = _keep_alive_working_s;
+  }
+  if (_keep_alive_s != previous_s) {
+    ESP_LOGI(MQTTRemoteLog::TAG, "Keep alive interval %lu s for next connection (was %lu s)",
+             (unsigned long)_keep_alive_s, (unsigned long)previous_s);
+    applyKeepAlive();
+  }
+}
+
+uint32_t MQTTRemote::pendingPings(int64_t now_us) {
+  if (!_connected || _keep_alive_s == 0) {
+    return 0;
+  }
+  // esp-mqtt pings after half the keep alive interval without sending anything.
+  return (now_us - _last_sent_us) / ((int64_t)_keep_alive_s * 500000);
+}
+
+uint32_t MQTTRemote::nextKeepAlive(uint32_t working_s) {
+  if (_keep_alive_failed_s == 0) {
+    return std::min(working_s * 2, _keep_alive_max_s);
+  }
+  // Halfway between the longest interval that worked and the shortest that did not, until they meet.
+  return std::max(working_s, (working_s + _keep_alive_failed_s) / 2);
+}
+
+void MQTTRemote::expireKeepAliveFailure(int64_t now_us) {
+  if (_keep_alive_failed_s != 0 && now_us - _keep_alive_failed_at_us >= KEEP_ALIVE_FAILURE_EXPIRY_US) {
+    ESP_LOGI(MQTTRemoteLog::TAG, "Keep alive interval %lu s can be tried again.", (unsigned long)_keep_alive_failed_s);
+    _keep_alive_failed_s = 0;
   }
+}
+
+void MQTTRemote::applyKeepAlive() {
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+  _mqtt_cfg.session.keepalive = _keep_alive_s;
+#else
+  _mqtt_cfg.keepalive = _keep_alive_s;
 #endif
+  // Called on the MQTT task, used on the next connection attempt.
+  esp_mqtt_set_config(_mqtt_client, &_mqtt_cfg);
+}
+
+MQTTRemote::KeepAliveStats MQTTRemote::keepAliveStats() {
+  std::lock_guard<std::mutex> lock(_keep_alive_mutex);
+  return {_keep_alive_s, _keep_alive_working_s, _keep_alive_failed_s,
+          _pings + pendingPings(esp_timer_get_time())};
+}
 
-  _mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
+void MQTTRemote::applyBrokerAddress() {
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+  _mqtt_cfg.broker.address.hostname = _broker_address.c_str();
+  esp_mqtt_set_config(_mqtt_client, &_mqtt_cfg);
+#endif
 }
 
 void MQTTRemote::start(std::function<void(bool)> on_connection_change, unsigned long task_size, uint8_t task_priority) {
@@ -197,12 +1082,7 @@ void MQTTRemote::start(std::function<void(bool)> on_connection_change, unsigned
     return;
   }
 
-  _connection_state_changed_event_group = xEventGroupCreate();
-
   _on_connection_change = on_connection_change;
-  if (_on_connection_change) {
-    xTaskCreate(&runTask, "MQTTRemote_main_task", task_size, this, task_priority, NULL);
-  }
 
   startInternal();
 }
@@ -219,38 +1099,514 @@ void MQTTRemote::start(EventGroupHandle_t connection_state_changed_event_group)
 }
 
 void MQTTRemote::startInternal() {
-  xEventGroupClearBits(_connection_state_changed_event_group, 0xFF);
+  if (_connection_state_changed_event_group) {
+    xEventGroupClearBits(_connection_state_changed_event_group, 0xFF);
+  }
+  if (_publish_lane_depth > 0 && xTaskCreate(publishLaneTask, "mqtt_publish", PUBLISH_LANE_STACK_SIZE, this,
+                                             _publish_lane_task_priority, &_publish_lane_task) != pdPASS) {
+    ESP_LOGE(MQTTRemoteLog::TAG, "Failed to create task for the publish lanes.");
+    return;
+  }
   ESP_ERROR_CHECK(esp_mqtt_client_register_event(_mqtt_client, MQTT_EVENT_ANY, onMqttEvent, this));
   ESP_ERROR_CHECK(esp_mqtt_client_start(_mqtt_client));
 
+  if (_brokers.size() > 1 && _failback_check_interval_s > 0) {
+    esp_timer_create_args_t timer_args = {};
+    timer_args.callback = onFailbackTimer;
+    timer_args.arg = this;
+    timer_args.name = "mqtt_failback";
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &_failback_timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(_failback_timer, (uint64_t)_failback_check_interval_s * 1000000));
+  }
+
   _started = true;
 }
 
-void MQTTRemote::runTask(void *pvParams) {
-  MQTTRemote *_this = static_cast<MQTTRemote *>(pvParams);
-  while (1) {
-    auto event_bits =
-        xEventGroupWaitBits(_this->_connection_state_changed_event_group,
-                            MQTTRemote::ConnectionState::Connected | MQTTRemote::ConnectionState::Disconnected, pdTRUE,
-                            pdFALSE, portMAX_DELAY);
-    if ((event_bits & MQTTRemote::ConnectionState::Connected) != 0) {
-      _this->_on_connection_change(true);
-    } else if ((event_bits & MQTTRemote::ConnectionState::Disconnected) != 0) {
-      _this->_on_connection_change(false);
+bool MQTTRemote::flush(uint32_t timeout_ms) {
+  auto deadline_us = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+  while (true) {
+    bool lanes_empty;
+    {
+      std::lock_guard<std::mutex> lock(_publish_lanes_mutex);
+      lanes_empty = std::all_of(_publish_lanes.begin(), _publish_lanes.end(),
+                                [](const PublishLane &lane) { return lane.queue.empty(); });
+    }
+    {
+      // Publishes from the MQTT task, not yet handed to the client.
+      std::lock_guard<std::mutex> lock(_deferred_publishes_mutex);
+      lanes_empty &= _deferred_publishes.empty();
     }
+    // The outbox has both messages not yet sent and QoS 1/2 messages not yet acknowledged.
+    if (lanes_empty && outboxSize() <= 0) {
+      return true;
+    }
+    if (esp_timer_get_time() >= deadline_us) {
+      ESP_LOGW(MQTTRemoteLog::TAG, "Flush timed out with %d bytes in the outbox.", outboxSize());
+      return false;
+    }
+    vTaskDelay(pdMS_TO_TICKS(FLUSH_POLL_MS));
+  }
+}
+
+bool MQTTRemote::stop(uint32_t timeout_ms) {
+  if (!_started || _stopped.exchange(true)) {
+    return true;
+  }
+  if (_failback_timer) {
+    esp_timer_stop(_failback_timer);
+  }
+  // A check already running sees _stopped once done, but might be using the client until then.
+  while (_failback_check_running) {
+    vTaskDelay(pdMS_TO_TICKS(FLUSH_POLL_MS));
+  }
+  _failback_pending = false;
+  if (_connected && !_last_will_topic.empty()) {
+    ESP_LOGI(MQTTRemoteLog::TAG, "Publishing offline status on topic '%s'", _last_will_topic.c_str());
+    publishMessage(_last_will_topic, LAST_WILL_MSG, true, 1, Priority::High);
+  }
+  bool flushed = flush(timeout_ms);
+  // Sends DISCONNECT if connected.
+  esp_mqtt_client_stop(_mqtt_client);
+  // The MQTT task might have seen the disconnect meanwhile, so only one of them notifies.
+  if (_connected.exchange(false)) {
+    notifyConnectionChange(false);
+  }
+
+  // Messages not published or acknowledged by now never will be.
+  std::vector<QueuedPublish> queued;
+  {
+    std::lock_guard<std::mutex> lock(_publish_lanes_mutex);
+    for (auto &lane : _publish_lanes) {
+      std::move(lane.queue.begin(), lane.queue.end(), std::back_inserter(queued));
+      lane.queue.clear();
+    }
+  }
+  std::map<int, PublishCallback> published_callbacks;
+  {
+    std::lock_guard<std::mutex> lock(_published_callbacks_mutex);
+    published_callbacks.swap(_published_callbacks);
+    _published_callbacks_closed = true;
+  }
+  for (auto &publish : queued) {
+    if (publish.on_published) {
+      publish.on_published(false);
+    }
+  }
+  for (auto &callback : published_callbacks) {
+    callback.second(false);
+  }
+  return flushed;
+}
+
+void MQTTRemote::notifyConnectionChange(bool connected) {
+  // Called directly from the MQTT task, so no dedicated task (and stack) is needed for the callback.
+  if (_on_connection_change) {
+    _on_connection_change(connected);
+  }
+  if (_connection_state_changed_event_group) {
+    xEventGroupSetBits(_connection_state_changed_event_group,
+                       connected ? ConnectionState::Connected : ConnectionState::Disconnected);
   }
 }
 
 bool MQTTRemote::publishMessage(std::string topic, std::string message, bool retain, uint8_t qos) {
+  return publishMessage(std::move(topic), std::move(message), retain, qos, Priority::Normal);
+}
+
+bool MQTTRemote::publishMessage(std::string topic, std::string message, bool retain, uint8_t qos,
+                                Priority priority) {
+  return publishMessage(std::move(topic), std::move(message), retain, qos, priority, {});
+}
+
+bool MQTTRemote::publishMessage(std::string topic, std::string message, bool retain, uint8_t qos, Priority priority,
+                                PublishCallback on_published) {
+  OperationMemoryScope memory_scope(*this, _publish_memory);
+  if (_traffic_recorder) {
+    _traffic_recorder({true, esp_timer_get_time(), topic, message});
+  }
+  bool delivered_locally = false;
+  if (_local_delivery) {
+    cacheRetainedValue(topic, message, retain);
+    delivered_locally = dispatchMessage(topic, message, esp_timer_get_time());
+    if (delivered_locally && !_forward_local_delivery) {
+      if (on_published) {
+        on_published(true);
+      }
+      return true;
+    }
+  }
+
   if (!connected()) {
+    if (delivered_locally) {
+      if (on_published) {
+        on_published(true);
+      }
+      return true;
+    }
     ESP_LOGW(MQTTRemoteLog::TAG, "Not connected to server when trying to publish to topic %s.", topic.c_str());
     return false;
   }
-  return esp_mqtt_client_publish(_mqtt_client, topic.c_str(), message.c_str(), message.length(), qos, retain) >= 0;
+  if (delivered_locally && !_no_local) {
+    rememberLocalDelivery(topic, message);
+  }
+  if (shouldCompress(topic, message)) {
+    std::string compressed;
+    if (MQTTCompression::compress(message, compressed)) {
+      message = std::move(compressed);
+    }
+  }
+  if (_publish_lane_depth == 0) {
+    QueuedPublish publish = {std::move(topic), std::move(message), retain, qos, esp_timer_get_time(),
+                             std::move(on_published)};
+    return publishInternal(publish);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_publish_lanes_mutex);
+    auto &lane = _publish_lanes[static_cast<size_t>(priority)];
+    if (lane.queue.size() >= _publish_lane_depth) {
+      lane.stats.dropped++;
+      ESP_LOGW(MQTTRemoteLog::TAG, "Publish lane %d full, dropping message to topic %s.", (int)priority,
+               topic.c_str());
+      return false;
+    }
+    lane.queue.push_back(
+        {std::move(topic), std::move(message), retain, qos, esp_timer_get_time(), std::move(on_published)});
+  }
+  // Published by the publish lane task, so that it is not up to the priority of this task when it is published.
+  xTaskNotifyGive(_publish_lane_task);
+  return true;
+}
+
+void MQTTRemote::publishLaneTask(void *arg) {
+  MQTTRemote *_this = static_cast<MQTTRemote *>(arg);
+  // Runs as long as the MQTTRemote, also after stop() (where publishing the queued messages fails).
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    _this->drainPublishLanes();
+  }
+}
+
+void MQTTRemote::drainPublishLanes() {
+  // Takes one message at a time, so that a message queued with a higher priority meanwhile is published next.
+  QueuedPublish publish;
+  while (takeNextQueuedPublish(publish)) {
+    if (!publishInternal(publish)) {
+      ESP_LOGW(MQTTRemoteLog::TAG, "Failed to publish queued message to topic %s.", publish.topic.c_str());
+      if (publish.on_published) {
+        publish.on_published(false);
+      }
+    }
+  }
+}
+
+bool MQTTRemote::takeNextQueuedPublish(QueuedPublish &publish) {
+  std::lock_guard<std::mutex> lock(_publish_lanes_mutex);
+
+  // Strict priority...
+  size_t selected = _publish_lanes.size();
+  for (size_t i = 0; i < _publish_lanes.size(); ++i) {
+    if (!_publish_lanes[i].queue.empty()) {
+      selected = i;
+      break;
+    }
+  }
+  if (selected == _publish_lanes.size()) {
+    return false;
+  }
+  // ...unless a lower priority lane has been skipped too many times.
+  for (size_t i = _publish_lanes.size() - 1; i > selected; --i) {
+    if (_publish_lane_max_skips > 0 && !_publish_lanes[i].queue.empty() &&
+        _publish_lanes[i].skipped >= _publish_lane_max_skips) {
+      selected = i;
+      break;
+    }
+  }
+  for (size_t i = 0; i < _publish_lanes.size(); ++i) {
+    if (i == selected) {
+      _publish_lanes[i].skipped = 0;
+    } else if (i > selected && !_publish_lanes[i].queue.empty()) {
+      _publish_lanes[i].skipped++;
+    }
+  }
+
+  auto &lane = _publish_lanes[selected];
+  publish = std::move(lane.queue.front());
+  lane.queue.pop_front();
+
+  uint32_t delay_us = esp_timer_get_time() - publish.queued_at_us;
+  lane.stats.published++;
+  lane.stats.queue_delay_total_us += delay_us;
+  lane.stats.queue_delay_max_us = std::max(lane.stats.queue_delay_max_us, delay_us);
+  return true;
+}
+
+MQTTRemote::PublishLaneStats MQTTRemote::publishLaneStats(Priority priority) {
+  std::lock_guard<std::mutex> lock(_publish_lanes_mutex);
+  return _publish_lanes[static_cast<size_t>(priority)].stats;
+}
+
+bool MQTTRemote::publishInternal(QueuedPublish &publish) {
+  if (!_topic_alias_manager) {
+    return publishToClient(publish);
+  }
+
+  // A topic alias is set as a publish property, which esp-mqtt uses for whatever is published next, so nothing else
+  // can be published in between. The MQTT task holds the esp-mqtt lock while calling the event handler, so it must not
+  // wait for a task that holds _publish_mutex, as that task might be waiting for esp-mqtt. If so, that task publishes
+  // the message instead.
+  if (xTaskGetCurrentTaskHandle() != _mqtt_task) {
+    bool published;
+    {
+      std::lock_guard<std::mutex> lock(_publish_mutex);
+      published = publishToClient(publish);
+    }
+    publishDeferred();
+    return published;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_deferred_publishes_mutex);
+    _deferred_publishes.push_back(std::move(publish));
+  }
+  publishDeferred();
+  return true;
+}
+
+void MQTTRemote::publishDeferred() {
+  while (true) {
+    {
+      // If another task holds the lock, it will publish what was deferred meanwhile once done.
+      std::unique_lock<std::mutex> publish_lock(_publish_mutex, std::try_to_lock);
+      if (!publish_lock.owns_lock()) {
+        return;
+      }
+      while (true) {
+        // Only removed once published, so flush() waits for it. Other tasks only add to the back, which keeps
+        // references to the other entries valid, and only the holder of _publish_mutex removes.
+        QueuedPublish *publish;
+        {
+          std::lock_guard<std::mutex> lock(_deferred_publishes_mutex);
+          if (_deferred_publishes.empty()) {
+            break;
+          }
+          publish = &_deferred_publishes.front();
+        }
+        if (!publishToClient(*publish)) {
+          ESP_LOGW(MQTTRemoteLog::TAG, "Failed to publish deferred message to topic %s.", publish->topic.c_str());
+          if (publish->on_published) {
+            publish->on_published(false);
+          }
+        }
+        std::lock_guard<std::mutex> lock(_deferred_publishes_mutex);
+        _deferred_publishes.pop_front();
+      }
+    }
+
+    // Something might have been deferred after the last take, but before releasing the lock.
+    std::lock_guard<std::mutex> lock(_deferred_publishes_mutex);
+    if (_deferred_publishes.empty()) {
+      return;
+    }
+  }
+}
+
+bool MQTTRemote::publishToClient(QueuedPublish &publish) {
+  int msg_id;
+  if (_topic_alias_manager && publish.qos == 0 && !_enqueue_publish) {
+    msg_id = publishWithTopicAlias(publish.topic, publish.message, publish.retain);
+  } else if (_enqueue_publish) {
+    // Store must be true, or QoS 0 messages would be dropped instead of sent by the MQTT task.
+    msg_id = esp_mqtt_client_enqueue(_mqtt_client, publish.topic.c_str(), publish.message.c_str(),
+                                     publish.message.length(), publish.qos, publish.retain, true);
+  } else {
+    msg_id = esp_mqtt_client_publish(_mqtt_client, publish.topic.c_str(), publish.message.c_str(),
+                                     publish.message.length(), publish.qos, publish.retain);
+  }
+  if (msg_id < 0) {
+    return false;
+  }
+  onMessageSent();
+  trackPublished(msg_id, publish.qos, std::move(publish.on_published));
+  return true;
+}
+
+void MQTTRemote::trackPublished(int msg_id, uint8_t qos, PublishCallback on_published) {
+  if (!on_published) {
+    return;
+  }
+  bool delivered = true;
+  if (qos > 0) {
+    std::unique_lock<std::mutex> lock(_published_callbacks_mutex);
+    auto ack = std::find(_recent_acks.begin(), _recent_acks.end(), msg_id);
+    if (ack != _recent_acks.end()) {
+      // Already acknowledged.
+      *ack = 0;
+    } else if (_published_callbacks_closed) {
+      // Published while stopping, will not be acknowledged.
+      delivered = false;
+    } else {
+      _published_callbacks.emplace(msg_id, std::move(on_published));
+      return;
+    }
+  }
+  on_published(delivered);
+}
+
+void MQTTRemote::onPublished(int msg_id, bool delivered) {
+  PublishCallback on_published;
+  {
+    std::lock_guard<std::mutex> lock(_published_callbacks_mutex);
+    auto callback = _published_callbacks.find(msg_id);
+    if (callback == _published_callbacks.end()) {
+      if (delivered) {
+        _recent_acks[_next_recent_ack] = msg_id;
+        _next_recent_ack = (_next_recent_ack + 1) % _recent_acks.size();
+      }
+      return;
+    }
+    on_published = std::move(callback->second);
+    _published_callbacks.erase(callback);
+  }
+  on_published(delivered);
+}
+
+int MQTTRemote::publishWithTopicAlias(const std::string &topic, const std::string &message, bool retain) {
+#ifdef MQTT_REMOTE_PROTOCOL_5
+  // Called with _publish_mutex held, see publishInternal().
+  TopicAliasManager::Alias alias;
+  {
+    std::lock_guard<std::mutex> lock(_topic_alias_mutex);
+    alias = _topic_alias_manager->aliasFor(topic);
+  }
+  esp_mqtt5_publish_property_config_t property = {};
+  property.topic_alias = alias.alias;
+  if (esp_mqtt5_client_set_publish_property(_mqtt_client, &property) == ESP_OK &&
+      esp_mqtt_client_publish(_mqtt_client, alias.send_topic ? topic.c_str() : "", message.c_str(), message.length(),
+                              0, retain) >= 0) {
+    // Message ID is always 0 for QoS 0.
+    return 0;
+  }
+
+  // Most likely rejected as the alias is above the Topic Alias Maximum of the broker. Send without alias instead.
+  ESP_LOGW(MQTTRemoteLog::TAG, "Failed to publish using topic alias %d for topic %s.", alias.alias, topic.c_str());
+  {
+    std::lock_guard<std::mutex> lock(_topic_alias_mutex);
+    _topic_alias_manager->forget(topic);
+  }
+  property.topic_alias = 0;
+  esp_mqtt5_client_set_publish_property(_mqtt_client, &property);
+#endif
+  return esp_mqtt_client_publish(_mqtt_client, topic.c_str(), message.c_str(), message.length(), 0, retain);
+}
+
+MQTTRemote::MemoryReport MQTTRemote::memoryReport() {
+  MemoryReport report = {};
+  if (_mqtt_task != nullptr) {
+    // In ESP-IDF, the high water mark is in bytes.
+    report.mqtt_task_free_stack_min_bytes = uxTaskGetStackHighWaterMark(_mqtt_task);
+  }
+  report.free_heap_bytes = esp_get_free_heap_size();
+  report.free_heap_min_bytes = esp_get_minimum_free_heap_size();
+  {
+    std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+    report.subscriptions = _subscriptions.size() + _streaming_subscriptions.size();
+    report.subscriptions_bytes = subscriptionsBytes();
+  }
+  {
+    std::scoped_lock lock(_retained_cache_mutex);
+    report.retained_cache_bytes = _retained_cache_bytes;
+  }
+  {
+    std::lock_guard<std::mutex> lock(_operation_memory_mutex);
+    report.subscribe = _subscribe_memory;
+    report.publish = _publish_memory;
+    report.dispatch = _dispatch_memory;
+    report.connect = _connect_memory;
+  }
+  return report;
+}
+
+size_t MQTTRemote::subscriptionsBytes() {
+  // Estimated from what the containers allocate, as the heap used by a single allocation is not known.
+  const size_t inline_capacity = std::string().capacity();
+  size_t bytes = 0;
+  for (const auto &subscription : _subscriptions) {
+    bytes += MAP_NODE_OVERHEAD_BYTES + sizeof(subscription);
+    if (subscription.first.capacity() > inline_capacity) {
+      bytes += subscription.first.capacity() + 1;
+    }
+    bytes += subscription.second.callbacks.size() *
+             (MAP_NODE_OVERHEAD_BYTES + sizeof(std::pair<const SubscriptionHandle, SubscriptionCallback>));
+  }
+  return bytes;
+}
+
+MQTTRemote::OperationMemoryScope::OperationMemoryScope(MQTTRemote &remote, OperationMemory &operation)
+    : _remote(remote), _operation(operation) {
+  if (_remote._track_operation_memory) {
+    _free_heap = esp_get_free_heap_size();
+  }
+}
+
+MQTTRemote::OperationMemoryScope::~OperationMemoryScope() {
+  if (_remote._track_operation_memory) {
+    _remote.recordOperationMemory(_operation, _free_heap);
+  }
+}
+
+void MQTTRemote::recordOperationMemory(OperationMemory &operation, uint32_t free_heap_before) {
+  int32_t bytes = (int32_t)(free_heap_before - esp_get_free_heap_size());
+  std::lock_guard<std::mutex> lock(_operation_memory_mutex);
+  operation.max_bytes = operation.count == 0 ? bytes : std::max(operation.max_bytes, bytes);
+  operation.last_bytes = bytes;
+  operation.total_bytes += bytes;
+  operation.count++;
+}
+
+bool MQTTRemote::checkMemoryBudget(const MemoryBudget &budget) {
+  auto report = memoryReport();
+  bool within_budget = true;
+  if (_mqtt_task != nullptr && report.mqtt_task_free_stack_min_bytes < budget.mqtt_task_free_stack_min_bytes) {
+    ESP_LOGE(MQTTRemoteLog::TAG, "MQTT task free stack %lu bytes, budget %lu bytes.",
+             (unsigned long)report.mqtt_task_free_stack_min_bytes,
+             (unsigned long)budget.mqtt_task_free_stack_min_bytes);
+    within_budget = false;
+  }
+  if (report.free_heap_min_bytes < budget.free_heap_min_bytes) {
+    ESP_LOGE(MQTTRemoteLog::TAG, "Minimum free heap %lu bytes, budget %lu bytes.",
+             (unsigned long)report.free_heap_min_bytes, (unsigned long)budget.free_heap_min_bytes);
+    within_budget = false;
+  }
+  size_t subscription_bytes = report.subscriptions > 0 ? report.subscriptions_bytes / report.subscriptions : 0;
+  if (budget.subscription_max_bytes > 0 && subscription_bytes > budget.subscription_max_bytes) {
+    ESP_LOGE(MQTTRemoteLog::TAG, "Heap per subscription %u bytes, budget %u bytes.", (unsigned)subscription_bytes,
+             (unsigned)budget.subscription_max_bytes);
+    within_budget = false;
+  }
+  const std::tuple<const char *, const OperationMemory &, int32_t> operations[] = {
+      {"subscribe()", report.subscribe, budget.subscribe_max_bytes},
+      {"publishMessage()", report.publish, budget.publish_max_bytes},
+      {"Dispatch", report.dispatch, budget.dispatch_max_bytes},
+      {"Connect", report.connect, budget.connect_max_bytes}};
+  for (const auto &[name, operation, max_bytes] : operations) {
+    if (max_bytes > 0 && operation.count > 0 && operation.max_bytes > max_bytes) {
+      ESP_LOGE(MQTTRemoteLog::TAG, "%s used up to %ld bytes of heap, budget %ld bytes.", name,
+               (long)operation.max_bytes, (long)max_bytes);
+      within_budget = false;
+    }
+  }
+  return within_budget;
+}
+
+int64_t MQTTRemote::topicAliasBytesSaved() {
+  std::lock_guard<std::mutex> lock(_topic_alias_mutex);
+  return _topic_alias_manager ? _topic_alias_manager->bytesSaved() : 0;
 }
 
 bool MQTTRemote::publishMessageVerbose(std::string topic, std::string message, bool retain, uint8_t qos) {
-  if (!connected()) {
+  // With local delivery, publishing can succeed while not connected.
+  if (!connected() && !_local_delivery) {
     ESP_LOGW(MQTTRemoteLog::TAG, "Not connected to server when trying to publish to topic %s.", topic.c_str());
     return false;
   }
@@ -262,26 +1618,194 @@ bool MQTTRemote::publishMessageVerbose(std::string topic, std::string message, b
 }
 
 bool MQTTRemote::subscribe(std::string topic, IMQTTRemote::SubscriptionCallback message_callback) {
-  if (_subscriptions.count(topic) > 0) {
-    ESP_LOGW(MQTTRemoteLog::TAG, "Topic %s is already subscribed to.", topic.c_str());
-    return false;
+  SubscriptionHandle handle;
+  return subscribe(std::move(topic), std::move(message_callback), handle);
+}
+
+bool MQTTRemote::subscribe(std::string topic, IMQTTRemote::SubscriptionCallback message_callback,
+                           SubscriptionHandle &handle) {
+  OperationMemoryScope memory_scope(*this, _subscribe_memory);
+  handle = 0;
+  bool already_subscribed;
+  {
+    std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+    if (_streaming_subscriptions.count(topic) > 0) {
+      ESP_LOGW(MQTTRemoteLog::TAG, "Topic %s is already subscribed to using subscribeStreaming().", topic.c_str());
+      return false;
+    }
+
+    handle = _next_subscription_handle++;
+    if (_next_subscription_handle == 0) {
+      _next_subscription_handle = 1;
+    }
+    auto subscription = _subscriptions.find(topic);
+    already_subscribed = subscription != _subscriptions.end();
+    if (already_subscribed) {
+      subscription->second.callbacks.emplace(handle, message_callback);
+    } else {
+      _subscriptions.emplace(topic, Subscription{{{handle, message_callback}}, {}});
+      if (hasWildcard(topic)) {
+        _wildcard_subscriptions++;
+      }
+      _pending_unsubscriptions.erase(topic);
+      // Checked while holding the lock, so that the topic is either subscribed to here, or when connected.
+      if (!connected()) {
+        ESP_LOGI(MQTTRemoteLog::TAG, "Not connected. Will subscribe once connected.");
+        _pending_subscriptions.insert(topic);
+        return false;
+      }
+    }
   }
 
-  _subscriptions.emplace(topic, message_callback);
+  if (already_subscribed) {
+    // Already subscribed on the broker, which will not resend any retained message. Use the cache instead.
+    std::vector<std::pair<std::string, std::string>> cached;
+    {
+      std::scoped_lock lock(_retained_cache_mutex);
+      for (const auto &value : _retained_cache) {
+        if (value.first == topic || (hasWildcard(topic) && topicMatchesFilter(topic, value.first))) {
+          cached.emplace_back(value.first, value.second.message);
+        }
+      }
+    }
+    for (const auto &value : cached) {
+      message_callback(value.first, value.second);
+    }
+    return true;
+  }
 
-  if (!connected()) {
-    ESP_LOGI(MQTTRemoteLog::TAG, "Not connected. Will subscribe once connected.");
+  return subscribeOnBroker(topic);
+}
+
+bool MQTTRemote::subscribeStreaming(std::string topic, StreamingCallbacks callbacks) {
+  {
+    std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+    if (_subscriptions.count(topic) > 0 || _streaming_subscriptions.count(topic) > 0) {
+      ESP_LOGW(MQTTRemoteLog::TAG, "Topic %s is already subscribed to.", topic.c_str());
+      return false;
+    }
+
+    _streaming_subscriptions.emplace(topic, callbacks);
+    _pending_unsubscriptions.erase(topic);
+
+    if (!connected()) {
+      ESP_LOGI(MQTTRemoteLog::TAG, "Not connected. Will subscribe once connected.");
+      _pending_subscriptions.insert(topic);
+      return false;
+    }
+  }
+
+  return subscribeOnBroker(topic);
+}
+
+bool MQTTRemote::shouldCompress(const std::string &topic, const std::string &message) {
+  if (_compress_min_size == 0 || message.size() < _compress_min_size) {
     return false;
   }
+  for (const auto &prefix : _compress_topic_prefixes) {
+    if (topic.compare(0, prefix.length(), prefix) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
 
+bool MQTTRemote::subscribeOnBroker(const std::string &topic) {
+#ifdef MQTT_REMOTE_PROTOCOL_5
+  // The subscribe property applies to the next subscribe only, so another task must not subscribe in between.
+  std::unique_lock<std::mutex> subscribe_lock(_subscribe_mutex, std::defer_lock);
+  auto set_no_local = [this]() {
+    esp_mqtt5_subscribe_property_config_t property = {};
+    property.no_local_flag = true;
+    esp_mqtt5_client_set_subscribe_property(_mqtt_client, &property);
+  };
+  if (_no_local) {
+    // The MQTT task cannot wait for the lock, as the task holding it might be waiting for the MQTT task to return
+    // from the event handler (holding the esp-mqtt lock).
+    if (xTaskGetCurrentTaskHandle() == _mqtt_task) {
+      subscribe_lock.try_lock();
+    } else {
+      subscribe_lock.lock();
+    }
+    set_no_local();
+  }
+#endif
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
-  return esp_mqtt_client_subscribe_single(_mqtt_client, topic.c_str(), 0) >= 0;
+  bool subscribed = esp_mqtt_client_subscribe_single(_mqtt_client, topic.c_str(), _subscription_qos) >= 0;
 #else
-  return esp_mqtt_client_subscribe(_mqtt_client, topic.c_str(), 0) >= 0;
+  bool subscribed = esp_mqtt_client_subscribe(_mqtt_client, topic.c_str(), _subscription_qos) >= 0;
+#endif
+#ifdef MQTT_REMOTE_PROTOCOL_5
+  if (_no_local && !subscribe_lock.owns_lock()) {
+    // The task holding the lock might have set its property already, which the subscribe above used. All properties
+    // are the same, so set it again for that task. If not used, the next subscribe uses it.
+    set_no_local();
+  }
 #endif
+  if (!subscribed) {
+    ESP_LOGW(MQTTRemoteLog::TAG, "Failed to subscribe to %s, will retry on next connect.", topic.c_str());
+    std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+    // Unless unsubscribed meanwhile.
+    if (_subscriptions.count(topic) > 0 || _streaming_subscriptions.count(topic) > 0) {
+      _pending_subscriptions.insert(topic);
+    }
+  }
+  return subscribed;
+}
+
+bool MQTTRemote::unsubscribeOnBroker(const std::string &topic) {
+  if (esp_mqtt_client_unsubscribe(_mqtt_client, topic.c_str()) >= 0) {
+    return true;
+  }
+  ESP_LOGW(MQTTRemoteLog::TAG, "Failed to unsubscribe from %s, will retry on next connect.", topic.c_str());
+  std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+  // Unless subscribed again meanwhile.
+  if (_subscriptions.count(topic) == 0 && _streaming_subscriptions.count(topic) == 0) {
+    _pending_unsubscriptions.insert(topic);
+  }
+  return false;
 }
 
 bool MQTTRemote::unsubscribe(std::string topic) {
-  _subscriptions.erase(topic);
-  return esp_mqtt_client_unsubscribe(_mqtt_client, topic.c_str()) >= 0;
+  bool was_connected;
+  {
+    std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+    was_connected = removeSubscription(topic);
+  }
+  forgetRetainedValues(topic);
+  return was_connected && unsubscribeOnBroker(topic);
+}
+
+bool MQTTRemote::unsubscribe(std::string topic, SubscriptionHandle handle) {
+  bool was_connected;
+  {
+    std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+    auto subscription = _subscriptions.find(topic);
+    if (subscription == _subscriptions.end() || subscription->second.callbacks.erase(handle) == 0) {
+      return false;
+    }
+    if (!subscription->second.callbacks.empty()) {
+      // Still subscribed for the other callbacks.
+      return true;
+    }
+    was_connected = removeSubscription(topic);
+  }
+  forgetRetainedValues(topic);
+  return was_connected && unsubscribeOnBroker(topic);
+}
+
+bool MQTTRemote::removeSubscription(const std::string &topic) {
+  if (_subscriptions.erase(topic) > 0 && hasWildcard(topic)) {
+    _wildcard_subscriptions--;
+  }
+  _streaming_subscriptions.erase(topic);
+  _pending_subscriptions.erase(topic);
+  // Checked while holding the lock, so that the topic is either unsubscribed from by the caller, or when connected.
+  // With a persistent session, the broker would otherwise keep the subscription.
+  bool was_connected = connected();
+  if (!was_connected) {
+    ESP_LOGI(MQTTRemoteLog::TAG, "Not connected. Will unsubscribe once connected.");
+    _pending_unsubscriptions.insert(topic);
+  }
+  return was_connected;
 }
@@ -2,14 +2,31 @@
 #define __MQTT_REMOTE_H__
 
 #include "IMQTTRemote.h"
+#include "MQTTCapture.h"
+#include "MQTTCompression.h"
+#include "TopicAliasManager.h"
 
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <freertos/task.h>
+#include <array>
+#include <atomic>
+#include <deque>
 #include <functional>
+#include <list>
 #include <map>
 #include <mqtt_client.h>
+#include <mutex>
 #include <optional>
+#include <set>
 #include <string>
+#include <vector>
+
+// MQTT 5 support in esp-mqtt requires ESP-IDF 5+ and CONFIG_MQTT_PROTOCOL_5 set in menuconfig.
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0) && defined(CONFIG_MQTT_PROTOCOL_5)
+#define MQTT_REMOTE_PROTOCOL_5
+#endif
 
 namespace MQTTRemoteLog {
 const char TAG[] = "MQTTRemote";
@@ -31,6 +48,197 @@ public:
     Disconnected = BIT1,
   };
 
+  /**
+   * Callbacks for a streaming subscription, see subscribeStreaming().
+   */
+  struct StreamingCallbacks {
+    /**
+     * Called when a new message starts, with the topic and the total length of the message in bytes.
+     */
+    std::function<void(const std::string &topic, size_t total_len)> on_begin;
+
+    /**
+     * Called for each fragment of the message, in order. offset is the position of data within the whole message.
+     * data is only valid for the duration of the call.
+     */
+    std::function<void(size_t offset, const char *data, size_t len)> on_chunk;
+
+    /**
+     * Called once the last fragment of the message has been delivered.
+     */
+    std::function<void()> on_end;
+
+    /**
+     * Called instead of on_end if the message was interrupted before the last fragment, as the connection was lost.
+     * The fragments delivered so far are then only part of the message and should be discarded.
+     */
+    std::function<void()> on_abort;
+  };
+
+  /**
+   * Dispatch statistics for one subscription, see dispatchStats().
+   */
+  struct DispatchStats {
+    // Number of messages dispatched to the subscription callback.
+    uint32_t count;
+    // Number of dispatches that took longer than Configuration::slow_handler_threshold_us.
+    uint32_t slow;
+    // Maximum and total time, in microseconds, spent in the callback.
+    uint32_t max_us;
+    uint64_t total_us;
+    // Histogram of the time spent in the callback. histogram[i] counts durations in [2^(i-1), 2^i) microseconds.
+    // histogram[0] counts durations below 1 µs, and the last bucket also counts everything longer.
+    std::array<uint32_t, 20> histogram;
+  };
+
+  /**
+   * Trace of one dispatch of a message to a subscription callback, see Configuration::dispatch_trace.
+   * Timestamps are in microseconds, from esp_timer_get_time().
+   */
+  struct DispatchTrace {
+    const std::string &topic_filter;
+    const std::string &topic;
+    // When the message was received from esp-mqtt.
+    int64_t received_us;
+    // When the callback was invoked and when it returned.
+    int64_t start_us;
+    int64_t end_us;
+  };
+
+  /**
+   * A received or published message, see Configuration::traffic_recorder.
+   */
+  struct TrafficRecord {
+    // True for a published message, false for a received message.
+    bool published;
+    // When the message was received or published, in microseconds, from esp_timer_get_time().
+    int64_t timestamp_us;
+    const std::string &topic;
+    const std::string &message;
+  };
+
+  /**
+   * Result of replay().
+   */
+  struct ReplayStats {
+    // Number of received messages replayed.
+    uint32_t messages;
+    // Time, in microseconds, spent replaying.
+    int64_t duration_us;
+    // True if the capture is not valid. Messages before the invalid part are still replayed.
+    bool failed;
+  };
+
+  /**
+   * Priority of an outgoing message, see publishMessage() and Configuration::publish_lane_depth.
+   */
+  enum class Priority : uint8_t {
+    High = 0,
+    Normal = 1,
+    Low = 2,
+  };
+
+  /**
+   * Statistics for one publish priority lane, see publishLaneStats().
+   */
+  struct PublishLaneStats {
+    // Number of messages taken from the lane and published (successful or not).
+    uint32_t published;
+    // Number of messages rejected as the lane was full.
+    uint32_t dropped;
+    // Total and maximum time, in microseconds, that messages have been waiting in the lane before being published.
+    uint64_t queue_delay_total_us;
+    uint32_t queue_delay_max_us;
+  };
+
+  /**
+   * Heap used by one kind of operation, see MemoryReport and Configuration::track_operation_memory.
+   */
+  struct OperationMemory {
+    // Number of operations measured.
+    uint32_t count;
+    // Heap used by the operation, in bytes, from the free heap before and after it. Positive for memory kept, like
+    // for a new subscription. Includes allocations by other tasks meanwhile, so measure without other activity.
+    int32_t last_bytes;
+    int32_t max_bytes;
+    int64_t total_bytes;
+  };
+
+  /**
+   * Memory usage, see memoryReport().
+   */
+  struct MemoryReport {
+    // Minimum amount of free stack, in bytes, the MQTT task has had since it was started (the high water mark). 0 if
+    // the MQTT task has not yet run. This is where subscription callbacks and the connection change callback run.
+    uint32_t mqtt_task_free_stack_min_bytes;
+    // Currently free heap, in bytes.
+    uint32_t free_heap_bytes;
+    // Minimum free heap, in bytes, since boot.
+    uint32_t free_heap_min_bytes;
+    // Number of subscriptions, including streaming subscriptions.
+    size_t subscriptions;
+    // Estimated heap, in bytes, used by the subscriptions (not streaming subscriptions): table entries, topics,
+    // callbacks and dispatch statistics, but not what the callbacks capture. Divide by subscriptions for the cost of
+    // one subscription.
+    size_t subscriptions_bytes;
+    // Bytes used by cached retained values, see Configuration::retained_cache_size.
+    size_t retained_cache_bytes;
+    // Heap used by subscribe(), publishMessage(), dispatching a received message to the callbacks, and connecting
+    // (from the connection attempt until connected and subscribed again). Only if
+    // Configuration::track_operation_memory is set.
+    OperationMemory subscribe;
+    OperationMemory publish;
+    OperationMemory dispatch;
+    OperationMemory connect;
+  };
+
+  /**
+   * Keep alive statistics, see keepAliveStats().
+   */
+  struct KeepAliveStats {
+    // Keep alive interval, in seconds, of the current connection, or of the next one if not connected.
+    uint32_t interval_s;
+    // Longest interval that has worked, and shortest one that has not in the last day (0 if none), in seconds. See
+    // Configuration::keep_alive_max_s.
+    uint32_t longest_working_s;
+    uint32_t shortest_failed_s;
+    // Estimated number of pings (PINGREQ) sent, from the time spent connected without sending anything.
+    uint32_t pings;
+  };
+
+  /**
+   * Connection statistics for one broker, see brokerStats().
+   */
+  struct BrokerStats {
+    std::string host;
+    int port;
+    // True for the broker currently used.
+    bool active;
+    // Number of successful connections and of failed connection attempts.
+    uint32_t connects;
+    uint32_t failures;
+    // Failed connection attempts since the last successful one.
+    uint32_t consecutive_failures;
+    // Time, in microseconds, from starting to connect until connected (CONNACK received), for the last connection.
+    // For the preferred broker while not connected to it, the TCP connect time of the last check. 0 if not measured.
+    uint32_t connect_latency_us;
+  };
+
+  /**
+   * Memory budget, see checkMemoryBudget(). Set a value to 0 to not check it.
+   */
+  struct MemoryBudget {
+    uint32_t mqtt_task_free_stack_min_bytes = 0;
+    uint32_t free_heap_min_bytes = 0;
+    // Maximum heap, in bytes, used per subscription, see MemoryReport::subscriptions_bytes.
+    size_t subscription_max_bytes = 0;
+    // Maximum heap, in bytes, used by one operation, see MemoryReport. Needs Configuration::track_operation_memory.
+    int32_t subscribe_max_bytes = 0;
+    int32_t publish_max_bytes = 0;
+    int32_t dispatch_max_bytes = 0;
+    int32_t connect_max_bytes = 0;
+  };
+
   /**
    * Additional configuration where most user can go with defaults.
    */
@@ -77,6 +285,260 @@ public:
      */
     uint32_t keep_alive_s = 10;
 
+    /**
+     * Adaptive keep alive: the longest keep alive interval, in seconds, to use. If larger than keep_alive_s, the
+     * interval starts at keep_alive_s and is raised up to the longest interval that the network path (like a NAT
+     * router dropping idle connections) and the broker tolerate. The interval is sent when connecting, so a longer one
+     * is only tried on the next reconnect after a connection has survived a few pings while idle. A connection is
+     * never dropped just to try a longer interval. When connections are lost while idle a few times in a row, the
+     * interval goes back to the longest one that worked, and longer ones are not tried again for a day.
+     * 0 (default) to always use keep_alive_s. See keepAliveStats().
+     * Pings are only sent after a period without sending anything, so a device publishing more often than that sends
+     * no pings at all.
+     */
+    uint32_t keep_alive_max_s = 0;
+
+    /**
+     * Topic for the online status, published on connect, and the last will ("offline"). If not set, this is
+     * "<client_id>/status". Set to an empty string to not publish any status or set any last will, for example for
+     * all but one connection in a MQTTRemotePool.
+     */
+    std::optional<std::string> status_topic = std::nullopt;
+
+    /**
+     * If true, publishMessage() will not write to the socket on the calling task. Instead, the message is put in the
+     * esp-mqtt outbox and publishMessage() returns immediately. The message is then sent by the MQTT task. Use this if
+     * publishing from a high priority task that cannot block for the duration of a (TLS) write on a slow link.
+     * The number of bytes waiting to be sent can be retrieved using outboxSize().
+     *
+     * If false (default), publishMessage() will send the message directly on the calling task.
+     */
+    bool enqueue_publish = false;
+
+    /**
+     * MQTT protocol version to use. If not set, the version set in menuconfig is used (normally MQTT 3.1.1).
+     * MQTT_PROTOCOL_V_5 requires ESP-IDF 5+ built with CONFIG_MQTT_PROTOCOL_5 set.
+     */
+    std::optional<esp_mqtt_protocol_ver_t> protocol_version = std::nullopt;
+
+    /**
+     * MQTT 5 only (protocol_version must be set to MQTT_PROTOCOL_V_5).
+     * Number of topic aliases to use for outgoing messages. Instead of sending the full topic on every publish, the
+     * most recently used topics are given a two byte alias. For long topics and small payloads, this saves most of
+     * the bytes on the wire. Must not be larger than the Topic Alias Maximum of the broker. Use
+     * topicAliasBytesSaved() to see the effect.
+     * Only used for QoS 0 messages not enqueued (see enqueue_publish), as QoS 1/2 messages might be resent on a new
+     * connection where the alias is no longer valid.
+     *
+     * This is also sent to the broker as the Topic Alias Maximum for incoming messages. Incoming aliases are resolved
+     * by esp-mqtt before the message reaches any subscription callback.
+     *
+     * Set to 0 (default) to not use topic aliases.
+     */
+    uint16_t topic_alias_maximum = 0;
+
+    /**
+     * If false, ask the broker to keep the session (subscriptions and queued QoS 1/2 messages) when disconnected.
+     * On reconnect, if the broker reports that the session is still present, the subscriptions are not sent again
+     * (except for those added while disconnected), and any QoS 1/2 messages sent while offline are delivered.
+     * This requires a stable client ID.
+     * For MQTT 5, session_expiry_interval_s must be set as well, or the broker will discard the session on disconnect.
+     *
+     * If true (default), every connection starts with a new clean session.
+     */
+    bool clean_session = true;
+
+    /**
+     * MQTT 5 only. For how long, in seconds, the broker should keep the session after disconnect when clean_session
+     * is false. 0 (default) means that the session ends on disconnect.
+     */
+    uint32_t session_expiry_interval_s = 0;
+
+    /**
+     * QoS to use for subscriptions (0, 1 or 2). Use 1 together with clean_session = false for the broker to queue
+     * messages while the device is offline.
+     */
+    uint8_t subscription_qos = 0;
+
+    /**
+     * If larger than 0, the packet ID and a hash of topic and payload of this many of the latest QoS 1 messages are
+     * kept. A message redelivered by the broker (with the DUP flag set, for example after a reconnect) matching one
+     * of these is not delivered again, so that callbacks do not have to be idempotent (like toggling a relay).
+     * Uses 8 bytes per message. Use suppressedDuplicates() to see the number of messages not delivered.
+     *
+     * If 0 (default), all messages are delivered.
+     */
+    uint16_t duplicate_window = 0;
+
+    /**
+     * If larger than 0, outgoing messages are put in one of three priority lanes (see Priority), each holding at most
+     * this many messages, and publishMessage() returns directly. A dedicated task (see publish_lane_task_priority)
+     * takes the messages from the lanes in priority order and publishes them, so a burst of low priority messages
+     * cannot delay high priority ones (like alarms or the online status) more than for the message currently being
+     * written. publishMessage() with a full lane fails. As publishing happens later, use the publishMessage() with a
+     * PublishCallback to know if a queued message could be published. Use publishLaneStats() to see the queueing delay
+     * per lane.
+     *
+     * If 0 (default), all messages are published directly in the order publishMessage() is called.
+     */
+    uint16_t publish_lane_depth = 0;
+
+    /**
+     * Starvation protection when using publish lanes (see publish_lane_depth). After this many messages in a row have
+     * been taken from higher priority lanes while a lower priority lane has been waiting, one message is taken from
+     * the lower priority lane.
+     * If 0, there is no starvation protection and messages are always taken in strict priority order.
+     */
+    uint16_t publish_lane_max_skips = 8;
+
+    /**
+     * Priority of the task publishing messages from the publish lanes (see publish_lane_depth). Should be higher than
+     * the priority of the tasks publishing, so that a high priority message is published as soon as it is queued.
+     */
+    uint8_t publish_lane_task_priority = 6;
+
+    /**
+     * If set, a warning is logged for every subscription callback that takes longer than this, in microseconds.
+     * Such dispatches are also counted in DispatchStats::slow. As callbacks run on the MQTT task, a slow callback
+     * delays all other messages.
+     */
+    std::optional<uint32_t> slow_handler_threshold_us = std::nullopt;
+
+    /**
+     * If true, the heap used by subscribe(), publishMessage(), dispatching and connecting is measured, from the free
+     * heap before and after each operation. See memoryReport().
+     */
+    bool track_operation_memory = false;
+
+    /**
+     * Optional hook invoked after every subscription callback with the timestamps of the dispatch. Runs on the MQTT
+     * task, so should be fast, for example storing the trace in a buffer. Use toChromeTraceEvent() to convert a trace
+     * to a Chrome trace/Perfetto compatible event.
+     */
+    std::function<void(const DispatchTrace &)> dispatch_trace;
+
+    /**
+     * Optional hook invoked for every received message before it is delivered to the subscription callbacks, and for
+     * every message given to publishMessage(). Use with MQTTCaptureWriter to record traffic, for example during an
+     * incident, that can be replayed later using replay(). Runs on the MQTT task for
+     * received messages and on the calling task for published messages, so should be fast.
+     */
+    std::function<void(const TrafficRecord &)> traffic_recorder;
+
+    /**
+     * If larger than 0, the last retained message of each subscribed topic is kept in memory, using at most this many
+     * bytes (topic and payload). When subscribing to a topic that is already subscribed to, the new callback gets the
+     * cached values directly from within subscribe(), instead of waiting for the broker (which does not resend
+     * retained messages for a subscription it already has). Once a retained message has been received for a topic,
+     * later messages on the same topic update the cached value as well. The least recently used values are evicted
+     * when the budget is exceeded. Messages larger than rx_buffer_size are never cached.
+     *
+     * If 0 (default), no values are cached.
+     */
+    size_t retained_cache_size = 0;
+
+    /**
+     * If true, publishMessage() to a topic matching a subscription of this MQTTRemote invokes the subscription
+     * callbacks directly on the calling task, without a round trip to the broker. This also works while disconnected.
+     * Use this when modules on the same device talk to each other over MQTT.
+     * The echo of such a message from the broker is not delivered a second time. With MQTT 5 (protocol_version
+     * MQTT_PROTOCOL_V_5), subscriptions use the No Local option so that the broker does not send the echo at all.
+     * Otherwise, echoes are recognized by topic and payload for 5 seconds after publishing.
+     * WARNING: without MQTT 5, a message from another client with the same topic and payload as one published
+     * locally within these 5 seconds is taken for the echo and dropped. Use MQTT 5, or set forward_local_delivery
+     * to false, if identical messages from other clients must be received.
+     *
+     * If false (default), all messages are delivered through the broker.
+     */
+    bool local_delivery = false;
+
+    /**
+     * When using local_delivery, if messages delivered locally should also be published to the broker, for other
+     * clients to receive. If false, messages matching a local subscription are only delivered locally.
+     */
+    bool forward_local_delivery = true;
+
+    /**
+     * If larger than 0, publishMessage() compresses messages of at least this many bytes using MQTTCompression, if
+     * that makes them smaller, for topics starting with one of compress_topic_prefixes. Use for large and repetitive
+     * messages like diagnostic dumps, to reduce traffic and the needed tx_buffer_size. Compressed messages can only
+     * be read by subscribers that decompress them, like this library with decompress set to true.
+     *
+     * If 0 (default), messages are never compressed.
+     */
+    size_t compress_min_size = 0;
+
+    /**
+     * Topic prefixes to compress messages for, see compress_min_size. Only list topics read by subscribers that
+     * decompress them, never topics read by other software, like Home Assistant discovery (homeassistant/).
+     *
+     * If empty (default), messages are never compressed.
+     */
+    std::vector<std::string> compress_topic_prefixes = {};
+
+    /**
+     * If true, compressed messages (see MQTTCompression) are decompressed before being delivered to the subscription
+     * callbacks. Messages that are not compressed are delivered as is.
+     */
+    bool decompress = false;
+
+    /**
+     * ESP-IDF 5+ only. If set, the broker hostname is resolved by MQTTRemote before a connection attempt and the
+     * resolved address is reused for this many seconds, independent of the DNS record TTL. If resolving fails, the
+     * last resolved address is used instead, so a flaky DNS server does not prevent reconnecting. The address is
+     * also resolved again after a failed connection attempt.
+     * When using TLS, the certificate is still verified against the hostname (unless verification.common_name is
+     * set). Not recommended for websockets, as the HTTP Host header will be the resolved address.
+     *
+     * If not set (default), the hostname is resolved by esp-mqtt on every connection attempt.
+     */
+    std::optional<uint32_t> broker_address_ttl_s = std::nullopt;
+
+    /**
+     * Optional hooks to persist the resolved broker address (see broker_address_ttl_s), for example in RTC memory or
+     * NVS, to skip the DNS lookup on the first connection after deep sleep or reboot.
+     * load_broker_address is called once upon MQTTRemote object creation and should return the last stored address,
+     * if any. A loaded address is considered fresh for broker_address_ttl_s seconds.
+     * store_broker_address is called with the new address every time it changes.
+     */
+    std::function<std::optional<std::string>()> load_broker_address;
+    std::function<void(const std::string &)> store_broker_address;
+
+    /**
+     * A broker to fail over to, see fallback_brokers. host, transport and verification are the same as for the
+     * broker given in the constructor.
+     */
+    struct Broker {
+      std::string host;
+      int port = 1883;
+      std::optional<esp_mqtt_transport_t> transport = std::nullopt;
+      verification_t verification = {};
+    };
+
+    /**
+     * Brokers to fail over to when the broker given in the constructor (the preferred broker) is unavailable, in
+     * order of preference. After failover_after_failures failed connection attempts in a row, the connection moves
+     * to the broker with the fewest failed attempts in a row, and if several, the lowest connect latency (brokers not
+     * yet tried first). While on a fallback broker, the preferred broker is checked in the background every
+     * failback_check_interval_s, and the connection moves back once it accepts connections again.
+     * Subscriptions, the online status and the last will follow the connection. Use brokerStats() for connect latency
+     * and failures per broker.
+     */
+    std::vector<Broker> fallback_brokers = {};
+
+    /**
+     * Number of failed connection attempts in a row before failing over, see fallback_brokers.
+     */
+    uint16_t failover_after_failures = 3;
+
+    /**
+     * How often, in seconds, to check if the preferred broker is available again while connected to a fallback
+     * broker. The check is a TCP connect with a timeout, in a short-lived task. If the preferred broker then rejects
+     * the MQTT connection, the connection returns to the fallback broker after the first failed attempt, and the
+     * interval is doubled (up to 64 times) until connecting to the preferred broker succeeds. 0 to never move back.
+     */
+    uint32_t failback_check_interval_s = 60;
+
     /**
      * Values, see esp_mqtt_transport_t:
      * - MQTT_TRANSPORT_OVER_TCP = mqtt
@@ -179,10 +641,11 @@ public:
    * Will connect to the server and setup any subscriptions as well as start the MQTT loop.
    * @param on_connection_change optional callback on connection state change. Will be called when the client is
    * connected to server (every time, so expect calls on reconnection), and on disconnect. The parameter will be true on
-   * new connection and false on disconnection. This callback will run from a dedicated task. Task size and priority can
-   * be set.
-   * @param task_size the stack size for the task that will call the on_connection_change callback, if set.
-   * @param task_priority the priority for the task that will call the on_connection_change callback, if set.
+   * new connection and false on disconnection. This callback is called from the MQTT task, so same as for subscription
+   * callbacks, don't do heavy operations or delays in it.
+   * @param task_size no longer used, as no dedicated task is created for the callback. Kept for source compatibility.
+   * @param task_priority no longer used, as no dedicated task is created for the callback. Kept for source
+   * compatibility.
    *
    * NOTE: Can only be called once WIFI has been setup! ESP-IDF will assert otherwise.
    */
@@ -201,6 +664,29 @@ public:
    */
   void start(EventGroupHandle_t connection_state_changed_event_group);
 
+  /**
+   * @brief Wait until all published messages have left: queued messages (publish lanes, publishes deferred by the
+   * MQTT task and the esp-mqtt outbox) have been sent, and QoS 1/2 messages have been acknowledged by the broker.
+   * Use before deep sleep instead of guessing a delay. Messages in the outbox while disconnected are sent once
+   * connected again, so this waits for that too.
+   * Must not be called from the MQTT task (subscription or connection callbacks), as the acknowledgements are handled
+   * there.
+   * @param timeout_ms maximum time to wait.
+   * @return true if all messages have left, false on timeout.
+   */
+  bool flush(uint32_t timeout_ms);
+
+  /**
+   * @brief Gracefully disconnect, for example before deep sleep. Publishes "offline" on the status topic (retained, QoS
+   * 1), waits for it and any other published messages to leave (see flush()), and then sends DISCONNECT and stops the
+   * client. As the disconnect is explicit, the broker does not publish the last will. Cannot be started again.
+   * Publish callbacks (see publishMessage()) for messages not yet delivered are invoked with false.
+   * Must not be called from the MQTT task.
+   * @param timeout_ms maximum time to wait for published messages to leave.
+   * @return true if all messages left before disconnecting, false on timeout.
+   */
+  bool stop(uint32_t timeout_ms);
+
   /**
    * @brief Publish a message.
    *
@@ -213,6 +699,30 @@ public:
    */
   bool publishMessage(std::string topic, std::string message, bool retain = false, uint8_t qos = 0) override;
 
+  /**
+   * @brief Publish a message with a priority. Same as publishMessage() above (which uses Priority::Normal), but if
+   * publish lanes are used (see Configuration::publish_lane_depth), the message is put in the lane for priority.
+   * @returns true on success (or if queued in a lane), or false on failure. When using Configuration::local_delivery,
+   * also true if delivered to a local subscription, even if not connected.
+   */
+  bool publishMessage(std::string topic, std::string message, bool retain, uint8_t qos, Priority priority);
+
+  /**
+   * Callback for when a published message has been delivered, see publishMessage().
+   */
+  typedef std::function<void(bool delivered)> PublishCallback;
+
+  /**
+   * @brief Same as publishMessage() above, but with a callback for when the message has been delivered. For QoS 1 and
+   * 2 this is when the broker has acknowledged the message (PUBACK/PUBCOMP), invoked from the MQTT task. For QoS 0
+   * this is once the message has been handed to esp-mqtt, or if only delivered locally (see
+   * Configuration::local_delivery). The callback is invoked with false if the message was dropped, for example from
+   * the esp-mqtt outbox after too many failed attempts.
+   * The callback is only invoked if this returns true, and is invoked at most once.
+   */
+  bool publishMessage(std::string topic, std::string message, bool retain, uint8_t qos, Priority priority,
+                      PublishCallback on_published);
+
   /**
    * Same as publishMessage(), but will print the message and topic and the result on serial.
    */
@@ -223,27 +733,149 @@ public:
    */
   bool connected() override { return _connected; }
 
+  /**
+   * @brief returns the number of times a connection to the MQTT server has been established.
+   */
+  uint32_t connectionCount() override { return _connection_count; }
+
+  /**
+   * @brief returns true if the broker reported that a previous session was still present on the last connect.
+   * Can only be true if Configuration::clean_session is false.
+   */
+  bool sessionPresent() { return _session_present; }
+
+  /**
+   * @brief returns the number of bytes currently in the esp-mqtt outbox, i.e. messages enqueued but not yet sent (see
+   * Configuration::enqueue_publish) and QoS 1/2 messages not yet acknowledged.
+   */
+  int outboxSize() { return esp_mqtt_client_get_outbox_size(_mqtt_client); }
+
+  /**
+   * @brief returns the connection statistics for each broker, the preferred broker first followed by the fallback
+   * brokers (see Configuration::fallback_brokers).
+   */
+  std::vector<BrokerStats> brokerStats();
+
+  /**
+   * @brief returns the keep alive interval and the estimated number of pings sent, see
+   * Configuration::keep_alive_max_s.
+   */
+  KeepAliveStats keepAliveStats();
+
+  /**
+   * @brief returns the number of redelivered messages not delivered again, see Configuration::duplicate_window.
+   */
+  uint32_t suppressedDuplicates() { return _suppressed_duplicates; }
+
+  /**
+   * @brief returns the dispatch statistics for the subscription for topic_filter, as given to subscribe(). Returns
+   * all zeros if there is no such subscription.
+   */
+  DispatchStats dispatchStats(const std::string &topic_filter);
+
+  /**
+   * @brief formats a dispatch trace as a Chrome trace event (complete event, "ph":"X"), that can be loaded in
+   * chrome://tracing or Perfetto when put in a JSON array.
+   */
+  static std::string toChromeTraceEvent(const DispatchTrace &trace);
+
+  /**
+   * @brief Replays the received messages in a capture written by MQTTCaptureWriter, delivering them to the
+   * subscription callbacks as if received from the broker, on the calling task. Published messages in the capture are
+   * skipped. Use this to benchmark the subscription callbacks with real traffic, using dispatchStats() or
+   * Configuration::dispatch_trace for the time spent in each callback.
+   *
+   * @param capture the capture to replay. Move the capture in to avoid copying it.
+   * @param speed 1 to replay at the recorded pace, 2 for twice as fast and so on. 0 (default) to replay as fast as
+   * possible. The pace is kept with a resolution of one FreeRTOS tick.
+   */
+  ReplayStats replay(std::string capture, float speed = 0);
+
+  /**
+   * @brief returns the statistics for the publish lane for priority, see Configuration::publish_lane_depth.
+   */
+  PublishLaneStats publishLaneStats(Priority priority);
+
+  /**
+   * @brief returns a report of the current memory usage, like the stack high water mark of the MQTT task.
+   */
+  MemoryReport memoryReport();
+
+  /**
+   * @brief checks the current memory usage against a budget. Logs an error for each value over budget.
+   * Useful in tests running on target to catch memory regressions. This is a runtime check, it cannot fail a build.
+   * @return true if within budget.
+   */
+  bool checkMemoryBudget(const MemoryBudget &budget);
+
+  /**
+   * @brief returns the number of bytes saved on the wire by using topic aliases, see
+   * Configuration::topic_alias_maximum.
+   */
+  int64_t topicAliasBytesSaved();
+
   /**
    * @brief Subscribe to a topic. The callback will be invoked on every new message.
-   * There can only be one callback per topic. If trying to subscribe to an already subscribe topic, it will be ignored.
+   * Several callbacks can subscribe to the same topic. Only the first one results in a subscription on the broker.
+   * The others are added locally and, if using retained_cache_size, get the cached retained values for the topic
+   * directly, invoked from the calling task before subscribe() returns.
+   * The topic can be a topic filter with + and # wildcards, in which case the callback is invoked with the actual
+   * topic of each message. If a message matches several subscriptions, all of them are invoked.
    * Don't do heavy operations in the callback or delays as this will block the MQTT callback.
    *
    * Can be called before being connected. All subscriptions will be (re-)subscribed to once a connection is
    * (re-)established.
    *
    * @param message_callback a message callback with the topic and the message. The topic is repeated for convenience,
-   * but it will always be for the subscribed topic.
+   * and will be the subscribed topic unless using wildcards.
    * @return true if a subcription was successful. Will return false if there is no active MQTT connection. In this
-   * case, the subscription will be performed once connected. Will return false if this subscription is already
-   * subscribed to.
+   * case, the subscription will be performed once connected. Will return true if a callback was added to an already
+   * subscribed topic. Will return false if this topic is subscribed to using subscribeStreaming().
    */
   bool subscribe(std::string topic, IMQTTRemote::SubscriptionCallback message_callback) override;
 
   /**
-   * @brief Unsubscribe a topic.
+   * @brief Same as subscribe() above, but also sets handle to identify this callback, see unsubscribe(topic, handle).
+   * handle is set to 0 if the callback was not added, which is only the case if the topic is subscribed to using
+   * subscribeStreaming().
+   */
+  bool subscribe(std::string topic, IMQTTRemote::SubscriptionCallback message_callback,
+                 SubscriptionHandle &handle) override;
+
+  /**
+   * @brief Subscribe to a topic and receive its messages as a stream of chunks instead of as one string.
+   * Use this for large messages like firmware or model blobs, where holding the whole message in memory is not an
+   * option. Each chunk is at most rx_buffer_size bytes, and the message is never reassembled by this library.
+   * For every received message, on_begin is called once, followed by on_chunk for each fragment in order and then
+   * on_end once the last byte has been delivered, or on_abort if the connection was lost before that.
+   * Same as for subscribe(), don't do heavy operations in the callbacks as this will block the MQTT callback.
+   *
+   * Can be called before being connected. All subscriptions will be (re-)subscribed to once a connection is
+   * (re-)established.
+   *
+   * @param callbacks the callbacks to invoke for each message. Any of them can be left empty.
+   * @return true if a subcription was successful. Will return false if there is no active MQTT connection. In this
+   * case, the subscription will be performed once connected. Will return false if this topic is already subscribed
+   * to, either using subscribe() or subscribeStreaming().
+   */
+  bool subscribeStreaming(std::string topic, StreamingCallbacks callbacks);
+
+  /**
+   * @brief Unsubscribe a topic. Works for both subscribe() and subscribeStreaming() subscriptions. Removes all
+   * callbacks for the topic.
+   * @return true if unsubscribed on the broker. If not connected, returns false and unsubscribes on the broker once
+   * connected, if the session is still present.
    */
   bool unsubscribe(std::string topic) override;
 
+  /**
+   * @brief Remove only the callback identified by handle, see subscribe(). Unsubscribes on the broker once the last
+   * callback for the topic has been removed.
+   * @return false if there is no such callback. true if other callbacks remain for the topic, otherwise same as for
+   * unsubscribe(topic).
+   */
+  bool unsubscribe(std::string topic, SubscriptionHandle handle) override;
+
   /**
    * @brief The client ID for this device. This is used for the last will / status
    * topic.Example, if this is "esp_now_router", then the status/last will topic will be "esp_now_router/status". This
@@ -252,8 +884,68 @@ public:
   std::string &clientId() override { return _client_id; }
 
 private:
+  struct BrokerState {
+    std::string host;
+    int port;
+    esp_mqtt_transport_t transport;
+    Configuration::verification_t verification;
+    uint32_t connects = 0;
+    uint32_t failures = 0;
+    uint32_t consecutive_failures = 0;
+    uint32_t connect_latency_us = 0;
+  };
+
   void startInternal();
 
+  static BrokerState parseBroker(std::string host, int port, std::optional<esp_mqtt_transport_t> transport,
+                                 const Configuration::verification_t &verification);
+
+  void applyBroker(size_t index);
+
+  void onBrokerConnected();
+
+  void onBrokerConnectFailed();
+
+  static void onFailbackTimer(void *arg);
+
+  static void failbackCheckTask(void *arg);
+
+  // Called on the MQTT task, moves to the preferred broker if found available by failbackCheckTask(). Returns true if
+  // moved.
+  bool applyPendingFailback();
+
+  static std::optional<uint32_t> probeBroker(const std::string &host, int port);
+
+  void onMessageSent();
+
+  void onKeepAliveDisconnect();
+
+  uint32_t pendingPings(int64_t now_us);
+
+  // Next interval to try, if working_s is the longest one that has worked.
+  uint32_t nextKeepAlive(uint32_t working_s);
+
+  void expireKeepAliveFailure(int64_t now_us);
+
+  void applyKeepAlive();
+
+  // Measures the heap used from construction to destruction, if Configuration::track_operation_memory.
+  class OperationMemoryScope {
+  public:
+    OperationMemoryScope(MQTTRemote &remote, OperationMemory &operation);
+    ~OperationMemoryScope();
+
+  private:
+    MQTTRemote &_remote;
+    OperationMemory &_operation;
+    uint32_t _free_heap = 0;
+  };
+
+  void recordOperationMemory(OperationMemory &operation, uint32_t free_heap_before);
+
+  // Called with _subscriptions_mutex held.
+  size_t subscriptionsBytes();
+
   /*
    * @brief Event handler registered to receive MQTT events
    *
@@ -266,17 +958,222 @@ private:
    */
   static void onMqttEvent(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data);
 
-  static void runTask(void *pvParams);
+  void notifyConnectionChange(bool connected);
+
+  // True if message should be compressed, see Configuration::compress_min_size.
+  bool shouldCompress(const std::string &topic, const std::string &message);
+
+  bool subscribeOnBroker(const std::string &topic);
+
+  bool unsubscribeOnBroker(const std::string &topic);
+
+  // Called holding _subscriptions_mutex. Returns true if connected, so that the caller should unsubscribe on the
+  // broker (after releasing the lock), otherwise that is done once connected.
+  bool removeSubscription(const std::string &topic);
+
+  void refreshBrokerAddress();
+
+  void applyBrokerAddress();
+
+  struct QueuedPublish {
+    std::string topic;
+    std::string message;
+    bool retain;
+    uint8_t qos;
+    int64_t queued_at_us;
+    PublishCallback on_published;
+  };
+
+  struct PublishLane {
+    std::deque<QueuedPublish> queue;
+    // Number of messages taken from higher priority lanes while this lane has been waiting.
+    uint16_t skipped = 0;
+    PublishLaneStats stats = {};
+  };
+
+  struct Subscription {
+    // By handle, so in the order subscribed.
+    std::map<SubscriptionHandle, SubscriptionCallback> callbacks;
+    DispatchStats stats;
+  };
+
+  struct ReceivedMessage {
+    uint16_t msg_id;
+    uint32_t hash;
+  };
+
+  struct LocalEcho {
+    uint32_t hash;
+    int64_t expiry_us;
+  };
+
+  struct RetainedValue {
+    std::string message;
+    // Position in _retained_cache_lru.
+    std::list<std::string>::iterator lru;
+  };
+
+  bool publishInternal(QueuedPublish &publish);
+
+  void publishDeferred();
+
+  bool publishToClient(QueuedPublish &publish);
+
+  void trackPublished(int msg_id, uint8_t qos, PublishCallback on_published);
+
+  void onPublished(int msg_id, bool delivered);
+
+  static void publishLaneTask(void *arg);
+
+  void drainPublishLanes();
+
+  bool takeNextQueuedPublish(QueuedPublish &publish);
+
+  int publishWithTopicAlias(const std::string &topic, const std::string &message, bool retain);
+
+  void onStreamingData(esp_mqtt_event_handle_t event);
+  void abortStream();
+
+  bool dispatchMessage(const std::string &topic, const std::string &message, int64_t received_us);
+
+  void rememberLocalDelivery(const std::string &topic, const std::string &message);
+
+  bool isLocalEcho(const std::string &topic, const std::string &message);
+
+  bool isDuplicate(esp_mqtt_event_handle_t event, const std::string &topic, const std::string &message);
+
+  void cacheRetainedValue(const std::string &topic, const std::string &message, bool retain);
+
+  void forgetRetainedValues(const std::string &topic_filter);
+
+  void recordDispatch(const std::string &topic_filter, const std::string &topic, int64_t received_us,
+                      int64_t start_us, int64_t end_us);
 
 private:
   bool _started = false;
+  bool _enqueue_publish;
   std::string _client_id;
-  bool _connected = false;
+  std::atomic<bool> _connected = false;
+  // Incremented before _connected is set, so a reader seeing the new connection also sees the new count.
+  std::atomic<uint32_t> _connection_count = 0;
+  bool _session_present = false;
+  uint8_t _subscription_qos;
+  // Latest QoS 1 messages received, see Configuration::duplicate_window.
+  std::vector<ReceivedMessage> _received_messages;
+  size_t _next_received_message = 0;
+  std::atomic<uint32_t> _suppressed_duplicates = 0;
   std::string _last_will_topic;
+  // Host of the active broker.
+  std::string _host;
+  std::mutex _brokers_mutex;
+  std::vector<BrokerState> _brokers;
+  size_t _active_broker = 0;
+  // Failed connection attempts in a row since moving to the active broker.
+  uint32_t _active_broker_failures = 0;
+  uint16_t _failover_after_failures;
+  uint32_t _failback_check_interval_s;
+  int64_t _connect_started_us = 0;
+  // Moved back to the preferred broker, but not yet connected to it.
+  bool _failback_attempted = false;
+  // Multiplies _failback_check_interval_s after moving back failed.
+  uint32_t _failback_backoff = 1;
+  int64_t _next_failback_check_us = 0;
+  esp_timer_handle_t _failback_timer = nullptr;
+  std::atomic<bool> _failback_check_running = false;
+  std::atomic<bool> _failback_pending = false;
+  std::atomic<bool> _stopped = false;
+  std::mutex _keep_alive_mutex;
+  uint32_t _keep_alive_s;
+  uint32_t _keep_alive_max_s;
+  uint32_t _keep_alive_working_s;
+  uint32_t _keep_alive_failed_s = 0;
+  int64_t _keep_alive_failed_at_us = 0;
+  // Connections lost while idle in a row, at an interval longer than _keep_alive_working_s.
+  uint32_t _keep_alive_idle_failures = 0;
+  // When anything was last sent, or connected, to estimate the number of pings.
+  int64_t _last_sent_us = 0;
+  uint32_t _pings = 0;
+  uint32_t _connection_pings = 0;
+  std::string _username;
+  std::string _password;
+  // Kept to be able to update the configuration, e.g. the broker address.
+  esp_mqtt_client_config_t _mqtt_cfg = {};
   esp_mqtt_client_handle_t _mqtt_client;
+  TaskHandle_t _mqtt_task = nullptr;
+  std::optional<uint32_t> _broker_address_ttl_s;
+  std::string _broker_address;
+  int64_t _broker_address_expiry_us = 0;
+  std::function<void(const std::string &)> _store_broker_address;
   std::function<void(bool)> _on_connection_change;
-  EventGroupHandle_t _connection_state_changed_event_group;
-  std::map<std::string, SubscriptionCallback> _subscriptions;
+  EventGroupHandle_t _connection_state_changed_event_group = nullptr;
+  uint16_t _publish_lane_depth;
+  uint16_t _publish_lane_max_skips;
+  uint8_t _publish_lane_task_priority;
+  std::mutex _publish_lanes_mutex;
+  std::array<PublishLane, 3> _publish_lanes;
+  // Publishes the messages in the lanes, see Configuration::publish_lane_depth.
+  TaskHandle_t _publish_lane_task = nullptr;
+  std::mutex _published_callbacks_mutex;
+  // Callbacks for QoS 1/2 messages not yet acknowledged, by message ID.
+  std::map<int, PublishCallback> _published_callbacks;
+  // Set by stop(), after which callbacks are invoked with false directly.
+  bool _published_callbacks_closed = false;
+  // Latest acknowledged message IDs without a callback, as the acknowledgement can be handled by the MQTT task before
+  // the callback is added.
+  std::array<int, 16> _recent_acks = {};
+  size_t _next_recent_ack = 0;
+  // Held while publishing when using topic aliases, see publishInternal().
+  std::mutex _publish_mutex;
+  std::mutex _deferred_publishes_mutex;
+  // Published on the MQTT task while another task was holding _publish_mutex.
+  std::deque<QueuedPublish> _deferred_publishes;
+  // Guards _topic_alias_manager. Never held while calling esp-mqtt.
+  std::mutex _topic_alias_mutex;
+  std::optional<TopicAliasManager> _topic_alias_manager;
+  std::optional<uint32_t> _slow_handler_threshold_us;
+  std::function<void(const DispatchTrace &)> _dispatch_trace;
+  std::function<void(const TrafficRecord &)> _traffic_recorder;
+  // Guards the subscriptions below, used both from the MQTT task and from the tasks calling subscribe(). Never held
+  // while calling a callback or esp-mqtt.
+  std::mutex _subscriptions_mutex;
+  std::map<std::string, Subscription> _subscriptions;
+  // Number of subscriptions in _subscriptions with + or # wildcards.
+  size_t _wildcard_subscriptions = 0;
+  SubscriptionHandle _next_subscription_handle = 1;
+  std::map<std::string, StreamingCallbacks> _streaming_subscriptions;
+  // Subscriptions not yet sent to the broker. Used to only send these on reconnect when the session is present.
+  std::set<std::string> _pending_subscriptions;
+  // Unsubscriptions not yet sent to the broker, sent on reconnect when the session is present.
+  std::set<std::string> _pending_unsubscriptions;
+  // Topic of the streaming message currently being received, if any.
+  std::optional<std::string> _active_stream_topic;
+  size_t _retained_cache_size;
+  size_t _retained_cache_bytes = 0;
+  std::mutex _retained_cache_mutex;
+  std::map<std::string, RetainedValue> _retained_cache;
+  // Most recently used topic first.
+  std::list<std::string> _retained_cache_lru;
+  bool _local_delivery;
+  bool _forward_local_delivery;
+  size_t _compress_min_size;
+  std::vector<std::string> _compress_topic_prefixes;
+  bool _decompress;
+  bool _track_operation_memory;
+  std::mutex _operation_memory_mutex;
+  OperationMemory _subscribe_memory = {};
+  OperationMemory _publish_memory = {};
+  OperationMemory _dispatch_memory = {};
+  OperationMemory _connect_memory = {};
+  // Free heap when the connection attempt started, only used on the MQTT task.
+  uint32_t _connect_free_heap = 0;
+  // True if the broker does not send our own messages back (MQTT 5 No Local).
+  bool _no_local = false;
+  // Held while setting the subscribe property and subscribing, see subscribeOnBroker().
+  std::mutex _subscribe_mutex;
+  std::mutex _local_echoes_mutex;
+  // Recently published messages also delivered locally, to drop their echo from the broker.
+  std::array<LocalEcho, 16> _local_echoes = {};
+  size_t _next_local_echo = 0;
 };
 
 #endif // __MQTT_REMOTE_H__
\ No newline at end of file
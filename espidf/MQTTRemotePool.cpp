@@ -0,0 +1,129 @@
+#include "MQTTRemotePool.h"
+#include <algorithm>
+
+#define SHARED_SUBSCRIPTION_PREFIX "$share/"
+
+MQTTRemotePool::MQTTRemotePool(std::string client_id, std::string host, int port, std::string username,
+                               std::string password, size_t connections, MQTTRemote::Configuration configuration)
+    : _client_id(client_id) {
+  for (size_t i = 0; i < std::max<size_t>(connections, 1); ++i) {
+    auto connection_client_id = _client_id;
+    if (i > 0) {
+      connection_client_id += "_" + std::to_string(i);
+      configuration.status_topic = "";
+    }
+    _connections.push_back(
+        std::make_unique<MQTTRemote>(connection_client_id, host, port, username, password, configuration));
+  }
+}
+
+void MQTTRemotePool::start(std::function<void(bool)> on_connection_change) {
+  _on_connection_change = on_connection_change;
+  for (auto &connection : _connections) {
+    connection->start([this](bool) { onConnectionChange(); });
+  }
+}
+
+bool MQTTRemotePool::publishMessage(std::string topic, std::string message, bool retain, uint8_t qos) {
+  auto &connection = connectionFor(topic);
+  return connection.publishMessage(std::move(topic), std::move(message), retain, qos);
+}
+
+bool MQTTRemotePool::publishMessageVerbose(std::string topic, std::string message, bool retain, uint8_t qos) {
+  auto &connection = connectionFor(topic);
+  return connection.publishMessageVerbose(std::move(topic), std::move(message), retain, qos);
+}
+
+bool MQTTRemotePool::subscribe(std::string topic, IMQTTRemote::SubscriptionCallback message_callback) {
+  if (topic.rfind(SHARED_SUBSCRIPTION_PREFIX, 0) != 0) {
+    return connectionFor(topic).subscribe(topic, message_callback);
+  }
+  bool success = true;
+  for (auto &connection : _connections) {
+    success &= connection->subscribe(topic, message_callback);
+  }
+  return success;
+}
+
+bool MQTTRemotePool::subscribe(std::string topic, IMQTTRemote::SubscriptionCallback message_callback,
+                               SubscriptionHandle &handle) {
+  if (topic.rfind(SHARED_SUBSCRIPTION_PREFIX, 0) != 0) {
+    return connectionFor(topic).subscribe(topic, message_callback, handle);
+  }
+  bool success = true;
+  std::vector<SubscriptionHandle> handles;
+  for (auto &connection : _connections) {
+    SubscriptionHandle connection_handle;
+    success &= connection->subscribe(topic, message_callback, connection_handle);
+    handles.push_back(connection_handle);
+  }
+  std::lock_guard<std::mutex> lock(_shared_handles_mutex);
+  handle = _next_shared_handle++;
+  if (_next_shared_handle == 0) {
+    _next_shared_handle = 1;
+  }
+  _shared_handles.emplace(handle, std::move(handles));
+  return success;
+}
+
+bool MQTTRemotePool::unsubscribe(std::string topic) {
+  if (topic.rfind(SHARED_SUBSCRIPTION_PREFIX, 0) != 0) {
+    return connectionFor(topic).unsubscribe(topic);
+  }
+  bool success = true;
+  for (auto &connection : _connections) {
+    success &= connection->unsubscribe(topic);
+  }
+  return success;
+}
+
+bool MQTTRemotePool::unsubscribe(std::string topic, SubscriptionHandle handle) {
+  if (topic.rfind(SHARED_SUBSCRIPTION_PREFIX, 0) != 0) {
+    return connectionFor(topic).unsubscribe(topic, handle);
+  }
+  std::vector<SubscriptionHandle> handles;
+  {
+    std::lock_guard<std::mutex> lock(_shared_handles_mutex);
+    auto found = _shared_handles.find(handle);
+    if (found == _shared_handles.end()) {
+      return false;
+    }
+    handles = std::move(found->second);
+    _shared_handles.erase(found);
+  }
+  bool success = true;
+  for (size_t i = 0; i < _connections.size(); ++i) {
+    success &= _connections[i]->unsubscribe(topic, handles[i]);
+  }
+  return success;
+}
+
+bool MQTTRemotePool::connected() { return connectedCount() == _connections.size(); }
+
+size_t MQTTRemotePool::connectedCount() {
+  return std::count_if(_connections.begin(), _connections.end(),
+                       [](const std::unique_ptr<MQTTRemote> &connection) { return connection->connected(); });
+}
+
+uint32_t MQTTRemotePool::connectionCount() {
+  uint32_t count = 0;
+  for (const auto &connection : _connections) {
+    count += connection->connectionCount();
+  }
+  return count;
+}
+
+MQTTRemote &MQTTRemotePool::connectionFor(const std::string &topic) {
+  return *_connections[std::hash<std::string>{}(topic) % _connections.size()];
+}
+
+void MQTTRemotePool::onConnectionChange() {
+  std::lock_guard<std::mutex> lock(_connection_change_mutex);
+  bool connected = this->connected();
+  if (connected != _was_connected) {
+    _was_connected = connected;
+    if (_on_connection_change) {
+      _on_connection_change(connected);
+    }
+  }
+}
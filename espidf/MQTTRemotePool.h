@@ -0,0 +1,104 @@
+#ifndef __MQTT_REMOTE_POOL_H__
+#define __MQTT_REMOTE_POOL_H__
+
+#include "IMQTTRemote.h"
+#include "MQTTRemote.h"
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * @brief IMQTTRemote over several MQTT connections to the same broker, for when one connection is not enough: one
+ * TCP stream, one MQTT task writing and dispatching, and per connection limits in the broker.
+ *
+ * - Publishing: each topic is always published on the same connection, selected by a hash of the topic, so the order
+ *   of messages on a topic is kept.
+ * - Subscribing: shared subscriptions ($share/<group>/<filter>) are subscribed to on all connections, and the broker
+ *   spreads the messages among them. As each connection has its own MQTT task, the callback can then be invoked from
+ *   several tasks at the same time. Other subscriptions are subscribed to on one connection, selected like for
+ *   publishing, so each message is only received once.
+ * - Status: only the first connection, with client ID <client_id>, publishes the online status and has the last will
+ *   on <client_id>/status. The other connections use the client IDs <client_id>_1, <client_id>_2 and so on.
+ *   connected() is true only when all connections are connected.
+ */
+class MQTTRemotePool : public IMQTTRemote {
+public:
+  /**
+   * @brief Construct a new MQTTRemotePool object. See MQTTRemote for the parameters.
+   *
+   * @param connections number of connections, at least 1.
+   * @param configuration configuration used for all connections, except for the status_topic.
+   */
+  MQTTRemotePool(std::string client_id, std::string host, int port, std::string username, std::string password,
+                 size_t connections)
+      : MQTTRemotePool(std::move(client_id), std::move(host), port, std::move(username), std::move(password),
+                       connections, MQTTRemote::Configuration{}) {}
+
+  MQTTRemotePool(std::string client_id, std::string host, int port, std::string username, std::string password,
+                 size_t connections, MQTTRemote::Configuration configuration);
+
+  /**
+   * @brief Start all connections, see MQTTRemote::start().
+   * @param on_connection_change optional callback, invoked when all connections have become connected (true), and
+   * when the first connection is lost (false). Called from the MQTT task of the connection that changed.
+   */
+  void start(std::function<void(bool)> on_connection_change = {});
+
+  bool publishMessage(std::string topic, std::string message, bool retain = false, uint8_t qos = 0) override;
+
+  bool publishMessageVerbose(std::string topic, std::string message, bool retain = false, uint8_t qos = 0) override;
+
+  /**
+   * @brief Subscribe to a topic, see the class description for how subscriptions are spread over the connections.
+   */
+  bool subscribe(std::string topic, IMQTTRemote::SubscriptionCallback message_callback) override;
+
+  bool subscribe(std::string topic, IMQTTRemote::SubscriptionCallback message_callback,
+                 SubscriptionHandle &handle) override;
+
+  bool unsubscribe(std::string topic) override;
+
+  bool unsubscribe(std::string topic, SubscriptionHandle handle) override;
+
+  /**
+   * @brief returns true if all connections are connected.
+   */
+  bool connected() override;
+
+  /**
+   * @brief returns the number of connections currently connected.
+   */
+  size_t connectedCount();
+
+  /**
+   * @brief returns the sum of connectionCount() of all connections, so it changes when any of them reconnects.
+   */
+  uint32_t connectionCount() override;
+
+  std::string &clientId() override { return _client_id; }
+
+  /**
+   * @brief The connections, for example for their statistics. Don't subscribe or publish on them directly.
+   */
+  const std::vector<std::unique_ptr<MQTTRemote>> &connections() { return _connections; }
+
+private:
+  MQTTRemote &connectionFor(const std::string &topic);
+
+  void onConnectionChange();
+
+  std::string _client_id;
+  std::vector<std::unique_ptr<MQTTRemote>> _connections;
+  std::mutex _connection_change_mutex;
+  bool _was_connected = false;
+  std::function<void(bool)> _on_connection_change;
+  std::mutex _shared_handles_mutex;
+  // For shared subscriptions, which are on all connections: the handle on each connection, by the handle given out.
+  std::map<SubscriptionHandle, std::vector<SubscriptionHandle>> _shared_handles;
+  SubscriptionHandle _next_shared_handle = 1;
+};
+
+#endif // __MQTT_REMOTE_POOL_H__
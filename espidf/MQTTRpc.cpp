@@ -0,0 +1,130 @@
+#include "MQTTRpc.h"
+#include <algorithm>
+#include <cstdlib>
+#include <esp_timer.h>
+
+MQTTRpc::MQTTRpc(IMQTTRemote &remote, size_t max_outstanding_calls)
+    : _remote(remote), _response_topic_prefix(_remote.clientId() + "/rpc/"),
+      _calls(std::max<size_t>(max_outstanding_calls, 1)) {
+  _remote.subscribe(
+      _response_topic_prefix + "+",
+      [this](const std::string &topic, const std::string &message) { onResponse(topic, message); },
+      _response_subscription);
+}
+
+MQTTRpc::~MQTTRpc() {
+  // By handle, to keep other callbacks for the same topic.
+  if (_response_subscription != 0) {
+    _remote.unsubscribe(_response_topic_prefix + "+", _response_subscription);
+  }
+}
+
+bool MQTTRpc::call(const std::string &topic, const std::string &payload, uint32_t timeout_ms,
+                   ResponseCallback callback) {
+  uint32_t id;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    // The slot is part of the ID, so a response can be matched to its call without searching.
+    size_t slot = _calls.size();
+    for (size_t i = 0; i < _calls.size(); ++i) {
+      size_t candidate = (_next_sequence + i) % _calls.size();
+      if (!_calls[candidate].active) {
+        slot = candidate;
+        break;
+      }
+    }
+    if (slot == _calls.size()) {
+      _stats.rejected++;
+      return false;
+    }
+
+    // Wrap before overflowing, as the slot must still be id % _calls.size().
+    id = (_next_sequence++ % (UINT32_MAX / _calls.size())) * _calls.size() + slot;
+    auto now_us = esp_timer_get_time();
+    _calls[slot] = {true, id, now_us, now_us + (int64_t)timeout_ms * 1000, std::move(callback)};
+  }
+
+  bool published = _remote.publishMessage(topic + "/" + _remote.clientId() + "/" + std::to_string(id), payload);
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (!published) {
+    auto &call = _calls[id % _calls.size()];
+    if (call.active && call.id == id) {
+      call.active = false;
+      call.callback = {};
+    }
+    return false;
+  }
+  _stats.calls++;
+  return true;
+}
+
+bool MQTTRpc::serve(const std::string &topic, RequestHandler handler) {
+  auto prefix_length = topic.length() + 1;
+  return _remote.subscribe(topic + "/+/+", [this, prefix_length, handler](const std::string &request_topic,
+                                                                          const std::string &message) {
+    // Request topic is <topic>/<caller client ID>/<correlation ID>.
+    auto separator = request_topic.find('/', prefix_length);
+    if (separator == std::string::npos) {
+      return;
+    }
+    auto caller = request_topic.substr(prefix_length, separator - prefix_length);
+    auto correlation_id = request_topic.substr(separator + 1);
+    _remote.publishMessage(caller + "/rpc/" + correlation_id, handler(message));
+  });
+}
+
+void MQTTRpc::handle() {
+  std::vector<Call> expired;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto now_us = esp_timer_get_time();
+    for (auto &call : _calls) {
+      if (call.active && now_us >= call.deadline_us) {
+        call.active = false;
+        expired.push_back(std::move(call));
+        _stats.timeouts++;
+      }
+    }
+  }
+
+  auto now_us = esp_timer_get_time();
+  for (auto &call : expired) {
+    if (call.callback) {
+      call.callback(Result::Timeout, "", now_us - call.started_us);
+    }
+  }
+}
+
+MQTTRpc::Stats MQTTRpc::stats() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _stats;
+}
+
+void MQTTRpc::onResponse(const std::string &topic, const std::string &message) {
+  uint32_t id = strtoul(topic.c_str() + _response_topic_prefix.length(), nullptr, 10);
+  uint32_t latency_us;
+  ResponseCallback callback;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto &call = _calls[id % _calls.size()];
+    if (!call.active || call.id != id) {
+      // Late response for a call that has timed out.
+      return;
+    }
+    call.active = false;
+    callback = std::move(call.callback);
+    latency_us = esp_timer_get_time() - call.started_us;
+    if (_stats.responses == 0 || latency_us < _stats.latency_min_us) {
+      _stats.latency_min_us = latency_us;
+    }
+    if (latency_us > _stats.latency_max_us) {
+      _stats.latency_max_us = latency_us;
+    }
+    _stats.latency_total_us += latency_us;
+    _stats.responses++;
+  }
+
+  if (callback) {
+    callback(Result::Ok, message, latency_us);
+  }
+}
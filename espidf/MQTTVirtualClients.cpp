@@ -0,0 +1,273 @@
+#include "MQTTVirtualClients.h"
+#include <algorithm>
+#include <esp_timer.h>
+
+#define STATUS_ONLINE "online"
+#define STATUS_OFFLINE "offline"
+
+bool MQTTVirtualClients::Client::publishMessage(std::string topic, std::string message, bool retain, uint8_t qos) {
+  seen();
+  return _clients._remote.publishMessage(std::move(topic), std::move(message), retain, qos);
+}
+
+bool MQTTVirtualClients::Client::publishMessageVerbose(std::string topic, std::string message, bool retain,
+                                                       uint8_t qos) {
+  seen();
+  return _clients._remote.publishMessageVerbose(std::move(topic), std::move(message), retain, qos);
+}
+
+bool MQTTVirtualClients::Client::subscribe(std::string topic, IMQTTRemote::SubscriptionCallback message_callback) {
+  SubscriptionHandle handle;
+  return _clients.subscribe(*this, std::move(topic), std::move(message_callback), handle);
+}
+
+bool MQTTVirtualClients::Client::subscribe(std::string topic, IMQTTRemote::SubscriptionCallback message_callback,
+                                           SubscriptionHandle &handle) {
+  return _clients.subscribe(*this, std::move(topic), std::move(message_callback), handle);
+}
+
+bool MQTTVirtualClients::Client::unsubscribe(std::string topic) { return _clients.unsubscribe(*this, topic, 0); }
+
+bool MQTTVirtualClients::Client::unsubscribe(std::string topic, SubscriptionHandle handle) {
+  return handle != 0 && _clients.unsubscribe(*this, topic, handle);
+}
+
+bool MQTTVirtualClients::Client::connected() { return _clients._remote.connected(); }
+
+uint32_t MQTTVirtualClients::Client::connectionCount() { return _clients._remote.connectionCount(); }
+
+void MQTTVirtualClients::Client::seen() { _clients.seen(*this); }
+
+void MQTTVirtualClients::Client::setOffline() { _clients.setOffline(*this); }
+
+bool MQTTVirtualClients::Client::online() {
+  std::lock_guard<std::mutex> lock(_clients._mutex);
+  return _online;
+}
+
+MQTTVirtualClients::MQTTVirtualClients(IMQTTRemote &remote, Configuration configuration)
+    : _remote(remote), _configuration(configuration) {}
+
+MQTTVirtualClients::Client &MQTTVirtualClients::add(std::string client_id) {
+  Client *client;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto &entry = _clients[client_id];
+    if (entry) {
+      return *entry;
+    }
+    entry.reset(new Client(*this, std::move(client_id)));
+    client = entry.get();
+    // Replace any retained status from before.
+    client->_status_pending = true;
+  }
+  return *client;
+}
+
+bool MQTTVirtualClients::remove(const std::string &client_id) {
+  std::unique_ptr<Client> client;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _clients.find(client_id);
+    if (found == _clients.end()) {
+      return false;
+    }
+    client = std::move(found->second);
+    _clients.erase(found);
+    if (client->_online) {
+      _removed_status_topics.push_back(client->_status_topic);
+    }
+  }
+
+  // Topic and handle on the gateway connection.
+  std::vector<std::pair<std::string, IMQTTRemote::SubscriptionHandle>> unused_subscriptions;
+  {
+    std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+    for (auto subscription = _subscriptions.begin(); subscription != _subscriptions.end();) {
+      auto &subscribers = subscription->second.subscribers;
+      subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(),
+                                       [&client](const Subscriber &subscriber) {
+                                         return subscriber.client == client.get();
+                                       }),
+                        subscribers.end());
+      if (subscribers.empty()) {
+        unused_subscriptions.emplace_back(subscription->first, subscription->second.remote_handle);
+        subscription = _subscriptions.erase(subscription);
+      } else {
+        ++subscription;
+      }
+    }
+  }
+  for (const auto &subscription : unused_subscriptions) {
+    // If still subscribing (0), subscribe() unsubscribes once done.
+    if (subscription.second != 0) {
+      _remote.unsubscribe(subscription.first, subscription.second);
+    }
+  }
+  return true;
+}
+
+MQTTVirtualClients::Client *MQTTVirtualClients::find(const std::string &client_id) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto found = _clients.find(client_id);
+  return found != _clients.end() ? found->second.get() : nullptr;
+}
+
+size_t MQTTVirtualClients::size() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _clients.size();
+}
+
+void MQTTVirtualClients::handle() {
+  bool connected = _remote.connected();
+  // After connected(), so a connection seen as connected is already counted.
+  uint32_t connection_count = _remote.connectionCount();
+  auto now_ms = esp_timer_get_time() / 1000;
+  // Status topic and online, to publish after releasing the lock.
+  std::vector<std::pair<std::string, bool>> statuses;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto &status_topic : _removed_status_topics) {
+      statuses.emplace_back(std::move(status_topic), false);
+    }
+    _removed_status_topics.clear();
+    // Also a reconnect if the connection was lost and established again since the last call.
+    bool connection_replaced = _was_connected && connected && connection_count != _connection_count;
+    if (_was_connected && (!connected || connection_replaced)) {
+      _generation++;
+    }
+    bool reconnected = connected && (!_was_connected || connection_replaced);
+    _was_connected = connected;
+    _connection_count = connection_count;
+
+    for (auto &entry : _clients) {
+      auto &client = *entry.second;
+      bool timed_out = client._online && _configuration.leaf_timeout_ms > 0 &&
+                       now_ms - client._last_seen_ms >= _configuration.leaf_timeout_ms;
+      if (timed_out || (reconnected && client._seen_generation != _generation)) {
+        client._online = false;
+      }
+      if (timed_out || reconnected || client._status_pending) {
+        statuses.emplace_back(client._status_topic, client._online);
+        client._status_pending = false;
+      }
+    }
+  }
+
+  for (const auto &status : statuses) {
+    publishStatus(status.first, status.second);
+  }
+}
+
+bool MQTTVirtualClients::subscribe(Client &client, std::string topic,
+                                   IMQTTRemote::SubscriptionCallback message_callback,
+                                   IMQTTRemote::SubscriptionHandle &handle) {
+  bool first;
+  {
+    std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+    handle = _next_subscription_handle++;
+    if (_next_subscription_handle == 0) {
+      _next_subscription_handle = 1;
+    }
+    auto &subscribers = _subscriptions[topic].subscribers;
+    first = subscribers.empty();
+    subscribers.push_back({&client, handle, std::move(message_callback)});
+  }
+  if (!first) {
+    return true;
+  }
+  // Not holding the lock, as subscribing might deliver a message directly.
+  IMQTTRemote::SubscriptionHandle remote_handle;
+  bool subscribed = _remote.subscribe(
+      topic,
+      [this, topic](std::string received_topic, std::string message) {
+        onMessage(topic, received_topic, message);
+      },
+      remote_handle);
+  bool unused;
+  {
+    std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+    auto subscription = _subscriptions.find(topic);
+    // Unless all unsubscribed meanwhile, or unsubscribed and subscribed again by someone else.
+    unused = subscription == _subscriptions.end() || subscription->second.remote_handle != 0;
+    if (!unused) {
+      subscription->second.remote_handle = remote_handle;
+    }
+  }
+  if (unused && remote_handle != 0) {
+    _remote.unsubscribe(topic, remote_handle);
+  }
+  return subscribed;
+}
+
+bool MQTTVirtualClients::unsubscribe(Client &client, const std::string &topic,
+                                     IMQTTRemote::SubscriptionHandle handle) {
+  IMQTTRemote::SubscriptionHandle remote_handle;
+  {
+    std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+    auto subscription = _subscriptions.find(topic);
+    if (subscription == _subscriptions.end()) {
+      return false;
+    }
+    auto &subscribers = subscription->second.subscribers;
+    auto removed =
+        std::remove_if(subscribers.begin(), subscribers.end(), [&client, handle](const Subscriber &subscriber) {
+          return subscriber.client == &client && (handle == 0 || subscriber.handle == handle);
+        });
+    if (removed == subscribers.end()) {
+      return false;
+    }
+    subscribers.erase(removed, subscribers.end());
+    if (!subscribers.empty()) {
+      return true;
+    }
+    remote_handle = subscription->second.remote_handle;
+    _subscriptions.erase(subscription);
+  }
+  // If still subscribing (0), subscribe() unsubscribes once done.
+  return remote_handle == 0 || _remote.unsubscribe(topic, remote_handle);
+}
+
+void MQTTVirtualClients::onMessage(const std::string &topic_filter, const std::string &topic,
+                                   const std::string &message) {
+  std::vector<IMQTTRemote::SubscriptionCallback> callbacks;
+  {
+    // Copy, as a callback might subscribe or unsubscribe.
+    std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+    auto subscription = _subscriptions.find(topic_filter);
+    if (subscription == _subscriptions.end()) {
+      return;
+    }
+    for (const auto &subscriber : subscription->second.subscribers) {
+      callbacks.push_back(subscriber.callback);
+    }
+  }
+  for (const auto &callback : callbacks) {
+    callback(topic, message);
+  }
+}
+
+void MQTTVirtualClients::seen(Client &client) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  client._last_seen_ms = esp_timer_get_time() / 1000;
+  client._seen_generation = _generation;
+  if (!client._online) {
+    client._online = true;
+    client._status_pending = true;
+  }
+}
+
+void MQTTVirtualClients::setOffline(Client &client) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (client._online) {
+    client._online = false;
+    client._status_pending = true;
+  }
+}
+
+void MQTTVirtualClients::publishStatus(const std::string &status_topic, bool online) {
+  // If not connected, the status is published again once connected.
+  if (_remote.connected()) {
+    _remote.publishMessage(status_topic, online ? STATUS_ONLINE : STATUS_OFFLINE, true, 0);
+  }
+}
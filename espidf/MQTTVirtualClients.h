@@ -0,0 +1,191 @@
+#ifndef __MQTT_VIRTUAL_CLIENTS_H__
+#define __MQTT_VIRTUAL_CLIENTS_H__
+
+#include "IMQTTRemote.h"
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Virtual clients on top of one MQTTRemote (or any other IMQTTRemote), for gateways representing several leaf
+ * devices, like an ESP-NOW to MQTT gateway. Each virtual client implements IMQTTRemote with its own client ID and
+ * status topic (<client_id>/status), but they all share the connection of the gateway, so there is no TCP/TLS
+ * connection or task per leaf.
+ *
+ * - Status: a virtual client goes online when seen (see Client::seen(), also done when publishing through it), and
+ *   offline when not seen for leaf_timeout_ms or on Client::setOffline(). Changes are published, retained, on the
+ *   status topic by handle(), so that they reach the broker in order. As the broker has no last will for a virtual
+ *   client, the status of all virtual clients is published again when the gateway has reconnected, where the ones not
+ *   seen since the connection was lost are published as offline.
+ * - Subscriptions: the virtual clients share one subscription table. Each topic is subscribed to once on the gateway
+ *   connection, and the messages are dispatched to all virtual clients subscribed to it.
+ * - Memory: each virtual client uses about 150 bytes, plus about 20 bytes per subscription and one table entry per
+ *   distinct topic. Strings of up to 15 characters are stored inline, longer ones take a heap allocation each: the
+ *   status topic once the client ID is longer than 8 characters, and the client ID twice (in the virtual client and
+ *   as its key) once it is longer than 15 characters.
+ *
+ * Call handle() periodically, for example every second, to publish status changes and to detect leaf timeouts and
+ * gateway reconnects.
+ */
+class MQTTVirtualClients {
+public:
+  struct Configuration {
+    /**
+     * Time, in milliseconds, a virtual client can go without being seen before it is considered offline. 0 to never
+     * time out.
+     */
+    uint32_t leaf_timeout_ms = 0;
+  };
+
+  /**
+   * @brief A virtual client, see MQTTVirtualClients. Use it like any other IMQTTRemote. connected() is the connection
+   * state of the gateway.
+   */
+  class Client : public IMQTTRemote {
+  public:
+    /**
+     * @brief Publish a message, see IMQTTRemote::publishMessage(). Also marks the virtual client as seen.
+     */
+    bool publishMessage(std::string topic, std::string message, bool retain = false, uint8_t qos = 0) override;
+
+    bool publishMessageVerbose(std::string topic, std::string message, bool retain = false, uint8_t qos = 0) override;
+
+    bool subscribe(std::string topic, IMQTTRemote::SubscriptionCallback message_callback) override;
+
+    bool subscribe(std::string topic, IMQTTRemote::SubscriptionCallback message_callback,
+                   SubscriptionHandle &handle) override;
+
+    /**
+     * @brief Remove the callbacks of this virtual client for the topic. Callbacks of other virtual clients are kept.
+     */
+    bool unsubscribe(std::string topic) override;
+
+    bool unsubscribe(std::string topic, SubscriptionHandle handle) override;
+
+    bool connected() override;
+
+    /**
+     * @brief returns the connectionCount() of the gateway.
+     */
+    uint32_t connectionCount() override;
+
+    std::string &clientId() override { return _client_id; }
+
+    /**
+     * @brief Mark the virtual client as seen, for example when receiving a message from the leaf. Goes online if not
+     * already online, published by the next handle().
+     */
+    void seen();
+
+    /**
+     * @brief Go offline now, for example when the leaf reports that it goes to sleep, published by the next handle().
+     * Goes online again when seen.
+     */
+    void setOffline();
+
+    /**
+     * @brief returns true if online, see MQTTVirtualClients.
+     */
+    bool online();
+
+  private:
+    friend class MQTTVirtualClients;
+    Client(MQTTVirtualClients &clients, std::string client_id)
+        : _clients(clients), _client_id(std::move(client_id)), _status_topic(_client_id + "/status") {}
+
+    MQTTVirtualClients &_clients;
+    std::string _client_id;
+    std::string _status_topic;
+    // Guarded by MQTTVirtualClients::_mutex.
+    bool _online = false;
+    int64_t _last_seen_ms = 0;
+    uint32_t _seen_generation = 0;
+    // Status changed, to be published by handle().
+    bool _status_pending = false;
+  };
+
+  /**
+   * @param remote the MQTTRemote (or any other IMQTTRemote) of the gateway.
+   */
+  MQTTVirtualClients(IMQTTRemote &remote) : MQTTVirtualClients(remote, Configuration{}) {}
+
+  /**
+   * @param remote the MQTTRemote (or any other IMQTTRemote) of the gateway.
+   * @param configuration leaf timeout.
+   */
+  MQTTVirtualClients(IMQTTRemote &remote, Configuration configuration);
+
+  /**
+   * @brief Add a virtual client, or get the existing one with this client ID. The virtual client starts offline.
+   * @param client_id client ID of the leaf, [a-zA-Z0-9_] only. The status topic is <client_id>/status.
+   */
+  Client &add(std::string client_id);
+
+  /**
+   * @brief Remove a virtual client. Unsubscribes its topics, and offline is published by the next handle() if it was
+   * online. Any reference to it is invalid afterwards.
+   * @return false if there is no virtual client with this client ID.
+   */
+  bool remove(const std::string &client_id);
+
+  /**
+   * @brief returns the virtual client with this client ID, or nullptr.
+   */
+  Client *find(const std::string &client_id);
+
+  /**
+   * @brief returns the number of virtual clients.
+   */
+  size_t size();
+
+  /**
+   * @brief Publish status changes, time out leaves and republish the status of all virtual clients after a
+   * reconnect. Call periodically, from one task at a time.
+   */
+  void handle();
+
+private:
+  bool subscribe(Client &client, std::string topic, IMQTTRemote::SubscriptionCallback message_callback,
+                 IMQTTRemote::SubscriptionHandle &handle);
+  // Removes the callback identified by handle, or all callbacks of the client for the topic if handle is 0.
+  bool unsubscribe(Client &client, const std::string &topic, IMQTTRemote::SubscriptionHandle handle);
+  void onMessage(const std::string &topic_filter, const std::string &topic, const std::string &message);
+  void seen(Client &client);
+  void setOffline(Client &client);
+  void publishStatus(const std::string &status_topic, bool online);
+
+private:
+  IMQTTRemote &_remote;
+  Configuration _configuration;
+  // Guards the virtual clients and their status. Never held while publishing, as publishing can block on the MQTT
+  // task, which might be dispatching a message to a callback that uses a virtual client.
+  std::mutex _mutex;
+  std::map<std::string, std::unique_ptr<Client>> _clients;
+  bool _was_connected = false;
+  // connectionCount() of the gateway on the last handle().
+  uint32_t _connection_count = 0;
+  // Incremented each time the gateway connection is lost.
+  uint32_t _generation = 0;
+  // Status topics of removed virtual clients that were online, to publish offline on by handle().
+  std::vector<std::string> _removed_status_topics;
+  std::mutex _subscriptions_mutex;
+  struct Subscriber {
+    Client *client;
+    IMQTTRemote::SubscriptionHandle handle;
+    IMQTTRemote::SubscriptionCallback callback;
+  };
+  struct Subscription {
+    // Handle of the subscription on the gateway connection, 0 while subscribing.
+    IMQTTRemote::SubscriptionHandle remote_handle = 0;
+    std::vector<Subscriber> subscribers;
+  };
+  // Subscriptions by topic (or topic filter).
+  std::map<std::string, Subscription> _subscriptions;
+  IMQTTRemote::SubscriptionHandle _next_subscription_handle = 1;
+};
+
+#endif // __MQTT_VIRTUAL_CLIENTS_H__
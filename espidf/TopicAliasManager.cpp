@@ -0,0 +1,52 @@
+#include "TopicAliasManager.h"
+
+// Topic alias property: 1 byte identifier + 2 bytes value.
+#define TOPIC_ALIAS_PROPERTY_SIZE 3
+
+TopicAliasManager::TopicAliasManager(uint16_t maximum) : _maximum(maximum) { _entries.reserve(maximum); }
+
+TopicAliasManager::Alias TopicAliasManager::aliasFor(const std::string &topic) {
+  if (_maximum == 0) {
+    return {0, true};
+  }
+
+  _tick++;
+  if (auto existing = _aliases.find(topic); existing != _aliases.end()) {
+    _entries[existing->second - 1].last_used = _tick;
+    _bytes_saved += static_cast<int64_t>(topic.length()) - TOPIC_ALIAS_PROPERTY_SIZE;
+    return {existing->second, false};
+  }
+
+  uint16_t alias;
+  if (_entries.size() < _maximum) {
+    _entries.push_back({topic, _tick});
+    alias = _entries.size();
+  } else {
+    // Reassign the least recently used alias.
+    size_t lru = 0;
+    for (size_t i = 1; i < _entries.size(); ++i) {
+      if (_entries[i].last_used < _entries[lru].last_used) {
+        lru = i;
+      }
+    }
+    _aliases.erase(_entries[lru].topic);
+    _entries[lru] = {topic, _tick};
+    alias = lru + 1;
+  }
+  _aliases[topic] = alias;
+  _bytes_saved -= TOPIC_ALIAS_PROPERTY_SIZE;
+  return {alias, true};
+}
+
+void TopicAliasManager::forget(const std::string &topic) {
+  if (auto existing = _aliases.find(topic); existing != _aliases.end()) {
+    // Keep the slot, but make it the first one to be reassigned.
+    _entries[existing->second - 1] = {"", 0};
+    _aliases.erase(existing);
+  }
+}
+
+void TopicAliasManager::reset() {
+  _entries.clear();
+  _aliases.clear();
+}
@@ -0,0 +1,65 @@
+#ifndef __TOPIC_ALIAS_MANAGER_H__
+#define __TOPIC_ALIAS_MANAGER_H__
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Keeps track of MQTT 5 topic aliases for outgoing messages on a single connection.
+ *
+ * Up to maximum topics are given an alias. When all aliases are taken, the least recently used one is reassigned to
+ * the new topic. The first publish on an alias must carry the full topic to establish the alias with the broker,
+ * following publishes can send an empty topic.
+ */
+class TopicAliasManager {
+public:
+  struct Alias {
+    // Alias to use for the publish, or 0 if no alias should be used.
+    uint16_t alias;
+    // True if the full topic has to be sent along with the alias to (re-)establish it.
+    bool send_topic;
+  };
+
+  /**
+   * @param maximum number of aliases to hand out. Must not be larger than the Topic Alias Maximum of the broker.
+   */
+  TopicAliasManager(uint16_t maximum);
+
+  /**
+   * @brief Get the alias to use for the next publish on topic, assigning or reassigning an alias if needed.
+   */
+  Alias aliasFor(const std::string &topic);
+
+  /**
+   * @brief Forget the alias for topic, if any. Call if a publish establishing an alias failed.
+   */
+  void forget(const std::string &topic);
+
+  /**
+   * @brief Forget all aliases. Must be called on every new connection, as aliases only live for one connection.
+   */
+  void reset();
+
+  /**
+   * @brief Number of bytes saved on the wire by using aliases, compared to always sending the full topic. Can be
+   * negative if aliases are being reassigned more often than reused.
+   */
+  int64_t bytesSaved() const { return _bytes_saved; }
+
+private:
+  struct Entry {
+    std::string topic;
+    uint32_t last_used;
+  };
+
+  uint16_t _maximum;
+  uint32_t _tick = 0;
+  int64_t _bytes_saved = 0;
+  // Index + 1 is the alias.
+  std::vector<Entry> _entries;
+  std::unordered_map<std::string, uint16_t> _aliases;
+};
+
+#endif // __TOPIC_ALIAS_MANAGER_H__
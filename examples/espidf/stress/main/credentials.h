@@ -0,0 +1,9 @@
+#ifndef __CREDENTIALS_H__
+#define __CREDENTIALS_H__
+
+const char mqtt_client_id[] = "stress";
+const char mqtt_host[] = "192.168.1.123";
+const char mqtt_username[] = "";
+const char mqtt_password[] = "";
+
+#endif // __CREDENTIALS_H__
\ No newline at end of file
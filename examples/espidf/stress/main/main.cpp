@@ -0,0 +1,170 @@
+#include "credentials.h"
+#include <MQTTRemote.h>
+#include <atomic>
+#include <cstdlib>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <string>
+
+#define TAG "stress"
+
+// Number of producer tasks for each round. Compare the rates between rounds for how publishing scales with the number
+// of tasks.
+const int PRODUCER_COUNTS[] = {1, 2, 4, 8};
+// Tasks subscribing and unsubscribing while publishing and dispatching.
+#define CHURN_TASK_COUNT 2
+#define ROUND_DURATION_MS 10000
+// Delay between publishes in each producer, 0 to publish as fast as possible.
+#define PRODUCER_DELAY_MS 1
+#define TASK_STACK_SIZE 4096
+#define TASK_PRIORITY 5
+// A round fails if any publish failed, or if fewer than this percentage of the published messages were received back.
+// Messages are QoS 0, so a few can be lost under load.
+#define MIN_RECEIVED_PERCENT 95
+
+MQTTRemote _mqtt_remote(mqtt_client_id, mqtt_host, 1883, mqtt_username, mqtt_password,
+                        {.rx_buffer_size = 2048, .tx_buffer_size = 2048, .keep_alive_s = 10});
+
+std::atomic<bool> _running = false;
+std::atomic<int> _running_tasks = 0;
+std::atomic<uint32_t> _published = 0;
+std::atomic<uint32_t> _publish_failures = 0;
+std::atomic<uint64_t> _publish_total_us = 0;
+std::atomic<uint32_t> _publish_max_us = 0;
+std::atomic<uint32_t> _received = 0;
+std::atomic<uint64_t> _latency_total_us = 0;
+std::atomic<uint32_t> _latency_max_us = 0;
+std::atomic<uint32_t> _churn_operations = 0;
+
+void updateMax(std::atomic<uint32_t> &max, uint32_t value) {
+  auto current = max.load();
+  while (value > current && !max.compare_exchange_weak(current, value)) {
+  }
+}
+
+// Publishes its own timestamp, so that the loopback latency can be measured when received.
+void producerTask(void *pvParameters) {
+  auto topic = _mqtt_remote.clientId() + "/stress/" + std::to_string((intptr_t)pvParameters);
+  while (_running) {
+    auto start_us = esp_timer_get_time();
+    bool published = _mqtt_remote.publishMessage(topic, std::to_string(start_us));
+    // Time spent in publishMessage(), including waiting for locks held by other tasks.
+    uint32_t duration_us = esp_timer_get_time() - start_us;
+    if (published) {
+      _published++;
+    } else {
+      _publish_failures++;
+    }
+    _publish_total_us += duration_us;
+    updateMax(_publish_max_us, duration_us);
+    vTaskDelay(pdMS_TO_TICKS(PRODUCER_DELAY_MS));
+  }
+  _running_tasks--;
+  vTaskDelete(nullptr);
+}
+
+// Subscribes to and unsubscribes from topics no one publishes to, to change the subscriptions while dispatching.
+void churnTask(void *pvParameters) {
+  auto topic = _mqtt_remote.clientId() + "/churn/" + std::to_string((intptr_t)pvParameters) + "/+";
+  while (_running) {
+    _mqtt_remote.subscribe(topic, [](const std::string &topic, const std::string &message) {});
+    _mqtt_remote.unsubscribe(topic);
+    _churn_operations += 2;
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+  _running_tasks--;
+  vTaskDelete(nullptr);
+}
+
+// Returns true if the round passed, see MIN_RECEIVED_PERCENT.
+bool runRound(int producers) {
+  _published = 0;
+  _publish_failures = 0;
+  _publish_total_us = 0;
+  _publish_max_us = 0;
+  _received = 0;
+  _latency_total_us = 0;
+  _latency_max_us = 0;
+  _churn_operations = 0;
+
+  _running = true;
+  _running_tasks = producers + CHURN_TASK_COUNT;
+  for (int i = 0; i < producers; ++i) {
+    xTaskCreate(producerTask, "producer", TASK_STACK_SIZE, (void *)(intptr_t)i, TASK_PRIORITY, nullptr);
+  }
+  for (int i = 0; i < CHURN_TASK_COUNT; ++i) {
+    xTaskCreate(churnTask, "churn", TASK_STACK_SIZE, (void *)(intptr_t)i, TASK_PRIORITY, nullptr);
+  }
+  vTaskDelay(pdMS_TO_TICKS(ROUND_DURATION_MS));
+  _running = false;
+  while (_running_tasks > 0) {
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+  // Let the last messages arrive.
+  vTaskDelay(pdMS_TO_TICKS(1000));
+
+  uint32_t published = _published;
+  uint32_t received = _received;
+  auto dispatch = _mqtt_remote.dispatchStats(_mqtt_remote.clientId() + "/stress/+");
+  ESP_LOGI(TAG, "%d producers: %lu published/s, %lu received/s (%lu%%), %lu failed, %lu subscription changes/s",
+           producers, published * 1000UL / ROUND_DURATION_MS, received * 1000UL / ROUND_DURATION_MS,
+           published > 0 ? received * 100UL / published : 0UL, (unsigned long)_publish_failures,
+           _churn_operations * 1000UL / ROUND_DURATION_MS);
+  ESP_LOGI(TAG, "  publishMessage(): avg %llu us, max %lu us", published > 0 ? _publish_total_us / published : 0ULL,
+           (unsigned long)_publish_max_us);
+  ESP_LOGI(TAG, "  loopback latency: avg %llu us, max %lu us", received > 0 ? _latency_total_us / received : 0ULL,
+           (unsigned long)_latency_max_us);
+  ESP_LOGI(TAG, "  callback: %lu calls, max %lu us", (unsigned long)dispatch.count, (unsigned long)dispatch.max_us);
+  auto memory = _mqtt_remote.memoryReport();
+  ESP_LOGI(TAG, "  MQTT task free stack min %lu bytes, free heap min %lu bytes",
+           (unsigned long)memory.mqtt_task_free_stack_min_bytes, (unsigned long)memory.free_heap_min_bytes);
+
+  bool passed = published > 0 && _publish_failures == 0 && received * 100ULL >= published * MIN_RECEIVED_PERCENT;
+  if (!passed) {
+    ESP_LOGE(TAG, "  round failed: %lu publish failures, %lu of %lu received", (unsigned long)_publish_failures,
+             (unsigned long)received, (unsigned long)published);
+  }
+  return passed;
+}
+
+extern "C" {
+void app_main();
+}
+
+void app_main(void) {
+  // TODO (you): You need to connect to WiFi here first.
+  // For a simple one line utility, see https://github.com/johboh/ConnectionHelper
+  // Once connected to wifi, continue with below.
+
+  // Receives what all producers publish, dispatched on the MQTT task.
+  _mqtt_remote.subscribe(_mqtt_remote.clientId() + "/stress/+",
+                         [](const std::string &topic, const std::string &message) {
+                           uint32_t latency_us = esp_timer_get_time() - strtoll(message.c_str(), nullptr, 10);
+                           _received++;
+                           _latency_total_us += latency_us;
+                           updateMax(_latency_max_us, latency_us);
+                         });
+
+  _mqtt_remote.start();
+  while (!_mqtt_remote.connected()) {
+    vTaskDelay(pdMS_TO_TICKS(100));
+  }
+
+  bool passed = true;
+  for (int producers : PRODUCER_COUNTS) {
+    passed &= runRound(producers);
+  }
+  if (passed) {
+    ESP_LOGI(TAG, "PASSED");
+  } else {
+    ESP_LOGE(TAG, "FAILED");
+  }
+
+  // Run forever.
+  while (1) {
+    vTaskDelay(500 / portTICK_PERIOD_MS);
+    fflush(stdout);
+  }
+}
@@ -0,0 +1,85 @@
+#include "MQTTBatcher.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <Arduino.h>
+
+MQTTBatcher::MQTTBatcher(IMQTTRemote &remote, std::string topic, Configuration configuration)
+    : _remote(remote), _topic(std::move(topic)), _configuration(configuration) {
+  _payload.reserve(_configuration.max_payload_size);
+}
+
+bool MQTTBatcher::add(const std::string &key, const std::string &json_value) {
+  auto now_ms = millis();
+
+  // Size of ,"key":value plus the closing brace.
+  size_t sample_size = key.length() + json_value.length() + 4;
+  if (sample_size + 1 > _configuration.max_payload_size) {
+    // Would not fit even alone in a batch ({"key":value}).
+    _dropped_samples++;
+    return false;
+  }
+  bool window_passed = _samples > 0 && now_ms - _batch_started_ms >= _configuration.window_ms;
+  if (window_passed || _payload.length() + sample_size + 1 > _configuration.max_payload_size || containsKey(key)) {
+    flushInternal();
+  }
+
+  if (_samples > 0 && (_payload.length() + sample_size + 1 > _configuration.max_payload_size || containsKey(key))) {
+    // Could not publish the previous batch, most likely as we are not connected. A key twice in the same JSON object
+    // would leave only one of the values to most parsers, so the new sample is dropped as well.
+    _dropped_samples++;
+    return false;
+  }
+
+  if (_samples == 0) {
+    _payload = "{";
+    _batch_started_ms = now_ms;
+  } else {
+    _payload += ",";
+  }
+  _payload += "\"" + key + "\":" + json_value;
+  _keys.push_back(key);
+  _samples++;
+  return true;
+}
+
+bool MQTTBatcher::add(const std::string &key, double value) {
+  if (!std::isfinite(value)) {
+    // JSON has no NaN or infinity.
+    return add(key, std::string("null"));
+  }
+  char buffer[24];
+  snprintf(buffer, sizeof(buffer), "%.7g", value);
+  return add(key, std::string(buffer));
+}
+
+void MQTTBatcher::handle() {
+  auto now_ms = millis();
+  if (_samples > 0 && now_ms - _batch_started_ms >= _configuration.window_ms) {
+    flushInternal();
+  }
+}
+
+bool MQTTBatcher::flush() { return flushInternal(); }
+
+bool MQTTBatcher::flushInternal() {
+  if (_samples == 0) {
+    return true;
+  }
+  if (!_remote.connected()) {
+    return false;
+  }
+  if (!_remote.publishMessage(_topic, _payload + "}", _configuration.retain, _configuration.qos)) {
+    return false;
+  }
+  _published_batches++;
+  _published_samples += _samples;
+  _samples = 0;
+  _payload.clear();
+  _keys.clear();
+  return true;
+}
+
+bool MQTTBatcher::containsKey(const std::string &key) {
+  return std::find(_keys.begin(), _keys.end(), key) != _keys.end();
+}
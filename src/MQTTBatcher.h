@@ -0,0 +1,112 @@
+#ifndef __MQTT_BATCHER_H__
+#define __MQTT_BATCHER_H__
+
+#include "IMQTTRemote.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Collects samples, each identified by a key, and publishes them together as one JSON object on a single
+ * topic. Instead of one MQTT message per sample, with full topic and header overhead for each, there is one message
+ * per batch.
+ *
+ * Example: with topic "my_device/sensors", adding temperature=21.5 and humidity=40 publishes
+ * {"temperature":21.5,"humidity":40} on "my_device/sensors".
+ *
+ * A batch is published when:
+ * - window_ms has passed since the first sample in the batch (checked in handle() and add()).
+ * - adding a sample would make the payload larger than max_payload_size.
+ * - a sample is added with a key already in the batch (so no sample is overwritten).
+ * - flush() is called.
+ *
+ * If not connected when a batch should be published, the batch is kept and published on the next call to handle()
+ * or add() once connected again. While disconnected, new samples that do not fit in the batch are dropped.
+ */
+class MQTTBatcher {
+public:
+  struct Configuration {
+    /**
+     * Maximum time, in milliseconds, from the first sample in a batch until the batch is published.
+     */
+    uint32_t window_ms = 1000;
+
+    /**
+     * Maximum size, in bytes, of the published payload. Should not be larger than the tx buffer size of the
+     * MQTTRemote.
+     */
+    size_t max_payload_size = 512;
+
+    /**
+     * Retain and QoS for the published batches.
+     */
+    bool retain = false;
+    uint8_t qos = 0;
+  };
+
+  /**
+   * @param remote the MQTTRemote (or any other IMQTTRemote) to publish batches with.
+   * @param topic the topic to publish batches on.
+   */
+  MQTTBatcher(IMQTTRemote &remote, std::string topic) : MQTTBatcher(remote, std::move(topic), Configuration{}) {}
+
+  /**
+   * @param remote the MQTTRemote (or any other IMQTTRemote) to publish batches with.
+   * @param topic the topic to publish batches on.
+   * @param configuration batch window and size limits.
+   */
+  MQTTBatcher(IMQTTRemote &remote, std::string topic, Configuration configuration);
+
+  /**
+   * @brief Add a sample to the current batch.
+   *
+   * @param key key for the sample in the JSON object. Should be [a-zA-Z0-9_] only.
+   * @param json_value the value, which must be valid JSON. For example a number, true/false or a quoted string.
+   * @return false if the sample was dropped, as it did not fit or its key was already in the batch and the previous
+   * batch could not be published, or as the sample alone is larger than max_payload_size.
+   */
+  bool add(const std::string &key, const std::string &json_value);
+
+  /**
+   * @brief Add a numeric sample to the current batch, see add() above. NaN and infinity are added as null.
+   */
+  bool add(const std::string &key, double value);
+
+  /**
+   * @brief Publish the current batch if the window has passed. Call periodically, at least every window_ms.
+   */
+  void handle();
+
+  /**
+   * @brief Publish the current batch now, if any. Call before a planned disconnect or deep sleep.
+   * @return true if there was nothing to publish or if the batch was published.
+   */
+  bool flush();
+
+  /**
+   * @brief Number of published batches and samples, and number of dropped samples.
+   */
+  uint32_t publishedBatches() { return _published_batches; }
+  uint32_t publishedSamples() { return _published_samples; }
+  uint32_t droppedSamples() { return _dropped_samples; }
+
+private:
+  bool flushInternal();
+  bool containsKey(const std::string &key);
+
+private:
+  IMQTTRemote &_remote;
+  std::string _topic;
+  Configuration _configuration;
+  // The JSON object being built, without the closing brace.
+  std::string _payload;
+  // Keys of the samples in the batch.
+  std::vector<std::string> _keys;
+  uint32_t _samples = 0;
+  unsigned long _batch_started_ms = 0;
+  uint32_t _published_batches = 0;
+  uint32_t _published_samples = 0;
+  uint32_t _dropped_samples = 0;
+};
+
+#endif // __MQTT_BATCHER_H__
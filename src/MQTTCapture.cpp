@@ -0,0 +1,113 @@
+#include "MQTTCapture.h"
+#include <algorithm>
+
+#define HEADER "MQC1"
+#define HEADER_SIZE 4
+#define FLAG_PUBLISHED 0x01
+#define FLAG_TOPIC_INDEX 0x02
+#define MAX_TOPICS 256
+
+static void appendVarint(std::string &out, uint64_t value) {
+  while (value >= 0x80) {
+    out += (char)(0x80 | (value & 0x7f));
+    value >>= 7;
+  }
+  out += (char)value;
+}
+
+MQTTCaptureWriter::MQTTCaptureWriter(std::function<void(const char *data, size_t size)> write) : _write(write) {}
+
+void MQTTCaptureWriter::add(bool published, int64_t timestamp_us, const std::string &topic,
+                            const std::string &message) {
+  std::string out;
+  if (!_header_written) {
+    out += HEADER;
+    _header_written = true;
+    _previous_timestamp_us = timestamp_us;
+  }
+
+  auto topic_index = std::find(_topics.begin(), _topics.end(), topic);
+  bool indexed = topic_index != _topics.end();
+  out += (char)((published ? FLAG_PUBLISHED : 0) | (indexed ? FLAG_TOPIC_INDEX : 0));
+  appendVarint(out, std::max<int64_t>(0, timestamp_us - _previous_timestamp_us));
+  _previous_timestamp_us = std::max(timestamp_us, _previous_timestamp_us);
+  if (indexed) {
+    appendVarint(out, topic_index - _topics.begin());
+  } else {
+    appendVarint(out, topic.size());
+    out += topic;
+    if (_topics.size() < MAX_TOPICS) {
+      _topics.push_back(topic);
+    }
+  }
+  appendVarint(out, message.size());
+  out += message;
+  _write(out.data(), out.size());
+}
+
+MQTTCaptureReader::MQTTCaptureReader(std::string capture) : _capture(std::move(capture)) {
+  if (_capture.compare(0, HEADER_SIZE, HEADER) != 0) {
+    _failed = !_capture.empty();
+    _position = _capture.size();
+  } else {
+    _position = HEADER_SIZE;
+  }
+}
+
+bool MQTTCaptureReader::readVarint(uint64_t &value) {
+  value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (_position >= _capture.size()) {
+      return false;
+    }
+    uint8_t byte = _capture[_position++];
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool MQTTCaptureReader::next(MQTTCaptureRecord &record) {
+  if (_failed || _position >= _capture.size()) {
+    return false;
+  }
+
+  uint8_t flags = _capture[_position++];
+  uint64_t delta_us = 0;
+  uint64_t topic = 0;
+  uint64_t message_size = 0;
+  if (!readVarint(delta_us) || !readVarint(topic)) {
+    _failed = true;
+    return false;
+  }
+  record.published = flags & FLAG_PUBLISHED;
+  _timestamp_us += delta_us;
+  record.timestamp_us = _timestamp_us;
+  if (flags & FLAG_TOPIC_INDEX) {
+    if (topic >= _topics.size()) {
+      _failed = true;
+      return false;
+    }
+    record.topic = _topics[topic];
+  } else {
+    if (topic > _capture.size() - _position) {
+      _failed = true;
+      return false;
+    }
+    record.topic = _capture.substr(_position, topic);
+    _position += topic;
+    if (_topics.size() < MAX_TOPICS) {
+      _topics.push_back(record.topic);
+    }
+  }
+
+  if (!readVarint(message_size) || message_size > _capture.size() - _position) {
+    _failed = true;
+    return false;
+  }
+  record.message = _capture.substr(_position, message_size);
+  _position += message_size;
+  return true;
+}
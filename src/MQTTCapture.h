@@ -0,0 +1,82 @@
+#ifndef __MQTT_CAPTURE_H__
+#define __MQTT_CAPTURE_H__
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * @brief One message in a capture, see MQTTCaptureWriter and MQTTCaptureReader.
+ */
+struct MQTTCaptureRecord {
+  // True for a published message, false for a received message.
+  bool published;
+  // Timestamp, in microseconds. When read using MQTTCaptureReader, relative to the first record.
+  int64_t timestamp_us;
+  std::string topic;
+  std::string message;
+};
+
+/**
+ * @brief Writes timestamped messages in a compact binary capture format, to be replayed later using
+ * MQTTRemote::replay(). Use together with MQTTRemote::Configuration::traffic_recorder.
+ *
+ * The format is the four bytes "MQC1" followed by one record per message:
+ * - flags (one byte): bit 0 set for published messages, bit 1 set if the topic is given as an index.
+ * - time since the previous record in microseconds (varint).
+ * - topic: index (varint) in the list of topics seen so far, or length (varint) and the topic. The first 256
+ *   distinct topics are added to the list, in the order they first appear.
+ * - message: length (varint) and the message.
+ */
+class MQTTCaptureWriter {
+public:
+  /**
+   * @param write called with the bytes to append to the capture, for example writing to a file. The header is
+   * written together with the first record.
+   */
+  MQTTCaptureWriter(std::function<void(const char *data, size_t size)> write);
+
+  /**
+   * @brief Add a message to the capture.
+   */
+  void add(bool published, int64_t timestamp_us, const std::string &topic, const std::string &message);
+
+private:
+  std::function<void(const char *data, size_t size)> _write;
+  bool _header_written = false;
+  int64_t _previous_timestamp_us = 0;
+  std::vector<std::string> _topics;
+};
+
+/**
+ * @brief Reads a capture written by MQTTCaptureWriter.
+ */
+class MQTTCaptureReader {
+public:
+  /**
+   * @param capture the whole capture. The reader keeps its own copy, move the capture in to avoid copying it.
+   */
+  MQTTCaptureReader(std::string capture);
+
+  /**
+   * @brief Read the next record. Returns false at the end of the capture or if the capture is invalid (see failed()).
+   */
+  bool next(MQTTCaptureRecord &record);
+
+  /**
+   * @brief returns true if the capture is not valid, for example truncated.
+   */
+  bool failed() { return _failed; }
+
+private:
+  bool readVarint(uint64_t &value);
+
+  std::string _capture;
+  size_t _position = 0;
+  bool _failed = false;
+  int64_t _timestamp_us = 0;
+  std::vector<std::string> _topics;
+};
+
+#endif // __MQTT_CAPTURE_H__
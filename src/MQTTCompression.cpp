@@ -0,0 +1,139 @@
+#include "MQTTCompression.h"
+#include <algorithm>
+#include <vector>
+
+#define MARKER_0 '\xff'
+#define MARKER_1 'Z'
+#define WINDOW_SIZE 4096
+#define MIN_MATCH 3
+#define MAX_MATCH 18
+#define HASH_BITS 10
+// Sanity limit for the uncompressed size, to not try to allocate garbage sizes.
+#define MAX_SIZE (16 * 1024 * 1024)
+
+static uint32_t hash3(const std::string &data, size_t pos) {
+  uint32_t value = (uint8_t)data[pos] << 16 | (uint8_t)data[pos + 1] << 8 | (uint8_t)data[pos + 2];
+  return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+bool MQTTCompression::isCompressed(const std::string &data) {
+  return data.size() >= 2 && data[0] == MARKER_0 && data[1] == MARKER_1;
+}
+
+bool MQTTCompression::compress(const std::string &data, std::string &compressed) {
+  std::string out;
+  out.reserve(data.size());
+  out += MARKER_0;
+  out += MARKER_1;
+  for (size_t size = data.size();; size >>= 7) {
+    if (size < 0x80) {
+      out += (char)size;
+      break;
+    }
+    out += (char)(0x80 | (size & 0x7f));
+  }
+
+  // Last position (modulo 2^16) for each hash. Stale or colliding entries are fine, as every match is verified.
+  std::vector<uint16_t> head(1 << HASH_BITS, 0);
+  size_t pos = 0;
+  while (pos < data.size()) {
+    size_t flags_index = out.size();
+    out += '\0';
+    for (int bit = 0; bit < 8 && pos < data.size(); ++bit) {
+      size_t best_length = 0;
+      size_t best_offset = 0;
+      if (pos + MIN_MATCH <= data.size()) {
+        auto hash = hash3(data, pos);
+        uint16_t offset = (uint16_t)pos - head[hash];
+        head[hash] = (uint16_t)pos;
+        if (offset > 0 && offset <= WINDOW_SIZE && offset <= pos) {
+          size_t length = 0;
+          size_t max_length = std::min<size_t>(MAX_MATCH, data.size() - pos);
+          while (length < max_length && data[pos - offset + length] == data[pos + length]) {
+            length++;
+          }
+          if (length >= MIN_MATCH) {
+            best_length = length;
+            best_offset = offset;
+          }
+        }
+      }
+
+      if (best_length > 0) {
+        out[flags_index] |= (char)(1 << bit);
+        out += (char)((best_offset - 1) & 0xff);
+        out += (char)(((best_offset - 1) >> 8) << 4 | (best_length - MIN_MATCH));
+        for (size_t i = 1; i < best_length && pos + i + MIN_MATCH <= data.size(); ++i) {
+          head[hash3(data, pos + i)] = (uint16_t)(pos + i);
+        }
+        pos += best_length;
+      } else {
+        out += data[pos];
+        pos++;
+      }
+    }
+    if (out.size() >= data.size()) {
+      return false;
+    }
+  }
+  compressed = std::move(out);
+  return true;
+}
+
+bool MQTTCompression::decompress(const std::string &data, std::string &decompressed) {
+  if (!isCompressed(data)) {
+    return false;
+  }
+  size_t in = 2;
+  size_t size = 0;
+  for (int shift = 0;; shift += 7) {
+    if (in >= data.size() || shift > 28) {
+      return false;
+    }
+    uint8_t byte = data[in++];
+    size |= (size_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      break;
+    }
+  }
+  if (size > MAX_SIZE) {
+    return false;
+  }
+
+  std::string out;
+  out.reserve(size);
+  while (out.size() < size) {
+    if (in >= data.size()) {
+      return false;
+    }
+    uint8_t flags = data[in++];
+    for (int bit = 0; bit < 8 && out.size() < size; ++bit) {
+      if ((flags & (1 << bit)) == 0) {
+        if (in >= data.size()) {
+          return false;
+        }
+        out += data[in++];
+        continue;
+      }
+      if (in + 2 > data.size()) {
+        return false;
+      }
+      uint8_t byte0 = data[in++];
+      uint8_t byte1 = data[in++];
+      size_t offset = ((size_t)(byte1 >> 4) << 8 | byte0) + 1;
+      size_t length = (byte1 & 0x0f) + MIN_MATCH;
+      if (offset > out.size() || out.size() + length > size) {
+        return false;
+      }
+      // Byte by byte, as the match can overlap with the output.
+      for (size_t i = 0; i < length; ++i) {
+        out += out[out.size() - offset];
+      }
+    }
+  }
+  if (in != data.size()) {
+    return false;
+  }
+  decompressed = std::move(out);
+  return true;
+}
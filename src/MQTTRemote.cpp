@@ -1,13 +1,135 @@
 #include "MQTTRemote.h"
+#include <algorithm>
+#include <vector>
+#ifdef ESP32
+#include <esp_system.h>
+#include <lwip/sockets.h>
+#endif
 
 #define RETRY_CONNECT_WAIT_MS 3000
 
+// Maximum time for the task to wait for data, to still send keep alive pings and reconnect.
+#define TASK_MAX_WAIT_MS 1000
+
+// For how long to look for the echo from the broker of a message delivered locally.
+#define LOCAL_ECHO_TIMEOUT_MS 5000
+
+// What a std::map node adds to the element: color and parent, left and right pointers.
+#define MAP_NODE_OVERHEAD_BYTES (4 * sizeof(void *))
+
+// Pings a connection must have survived before trying a longer keep alive interval.
+#define KEEP_ALIVE_PROBE_PINGS 3
+
+// Connections lost while idle in a row before a keep alive interval is considered too long.
+#define KEEP_ALIVE_FAILURES 2
+
+// After this time, a keep alive interval considered too long is tried again, as the network path might have changed.
+#define KEEP_ALIVE_FAILURE_EXPIRY_MS (24UL * 60 * 60 * 1000)
+
+// FNV-1a hash of topic and message.
+static uint32_t hashMessage(const std::string &topic, const std::string &message) {
+  uint32_t hash = 2166136261u;
+  auto add = [&hash](const std::string &data) {
+    for (unsigned char c : data) {
+      hash = (hash ^ c) * 16777619u;
+    }
+  };
+  add(topic);
+  hash = (hash ^ 0xff) * 16777619u;
+  add(message);
+  return hash;
+}
+
+// Free heap, in bytes, 0 if not known.
+static uint32_t freeHeap() {
+#ifdef ESP32
+  return esp_get_free_heap_size();
+#elif ESP8266
+  return ESP.getFreeHeap();
+#else
+  return 0;
+#endif
+}
+
+// Escapes value for use in a JSON string.
+static std::string escapeJson(const std::string &value) {
+  static const char *hex = "0123456789abcdef";
+  std::string escaped;
+  escaped.reserve(value.size());
+  for (unsigned char c : value) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+      escaped += c;
+    } else if (c < 0x20) {
+      escaped += "\\u00";
+      escaped += hex[c >> 4];
+      escaped += hex[c & 0xf];
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+#define SHARED_SUBSCRIPTION_PREFIX "$share/"
+
+// Messages for a shared subscription ($share/<group>/<filter>) have the actual topic, so these are matched like a
+// filter with wildcards.
+static bool hasWildcard(const std::string &filter) {
+  return filter.find_first_of("+#") != std::string::npos || filter.rfind(SHARED_SUBSCRIPTION_PREFIX, 0) == 0;
+}
+
+// True if topic matches the MQTT topic filter, which can contain + (single level) and # (multi level) wildcards.
+static bool topicMatchesFilter(const std::string &filter, const std::string &topic) {
+  size_t f = 0;
+  size_t t = 0;
+  if (filter.rfind(SHARED_SUBSCRIPTION_PREFIX, 0) == 0) {
+    // Skip the share name.
+    f = filter.find('/', sizeof(SHARED_SUBSCRIPTION_PREFIX) - 1);
+    if (f == std::string::npos) {
+      return false;
+    }
+    f++;
+  }
+  while (f < filter.length()) {
+    if (filter[f] == '#') {
+      return true;
+    } else if (filter[f] == '+') {
+      while (t < topic.length() && topic[t] != '/') {
+        t++;
+      }
+      f++;
+    } else if (t < topic.length() && filter[f] == topic[t]) {
+      f++;
+      t++;
+    } else {
+      // "a/#" also matches "a".
+      return t == topic.length() && filter.compare(f, std::string::npos, "/#") == 0;
+    }
+  }
+  return t == topic.length();
+}
+
 MQTTRemote::MQTTRemote(std::string client_id, std::string host, int port, std::string username, std::string password,
                        Configuration configuration)
     : _client_id(client_id), _host(host), _username(username), _password(password),
-      _receive_verbose(configuration.receive_verbose), _mqtt_client(configuration.buffer_size) {
+      _receive_verbose(configuration.receive_verbose), _subscription_qos(configuration.subscription_qos),
+      _mqtt_client(configuration.buffer_size), _slow_handler_threshold_us(configuration.slow_handler_threshold_us),
+      _dispatch_trace(configuration.dispatch_trace), _traffic_recorder(configuration.traffic_recorder),
+      _local_delivery(configuration.local_delivery),
+      _forward_local_delivery(configuration.forward_local_delivery),
+      _compress_min_size(configuration.compress_min_size),
+      _compress_topic_prefixes(configuration.compress_topic_prefixes), _decompress(configuration.decompress),
+      _track_operation_memory(configuration.track_operation_memory),
+      _keep_alive_s(configuration.keep_alive_s), _keep_alive_max_s(configuration.keep_alive_max_s),
+      _keep_alive_working_s(configuration.keep_alive_s) {
+#ifdef ESP32
+  _task_size = configuration.task_size;
+  _task_priority = configuration.task_priority;
+#endif
   _mqtt_client.begin(_host.c_str(), port, _wifi_client);
   _mqtt_client.setKeepAlive(configuration.keep_alive_s);
+  _mqtt_client.setCleanSession(configuration.clean_session);
   std::function<void(MQTTClient * client, char topic[], char bytes[], int length)> callback =
       std::bind(&MQTTRemote::onMessage, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3,
                 std::placeholders::_4);
@@ -15,22 +137,104 @@ MQTTRemote::MQTTRemote(std::string client_id, std::string host, int port, std::s
 }
 
 void MQTTRemote::handle() {
+#ifdef ESP32
+  if (_task_size) {
+    if (_task == nullptr) {
+      xTaskCreate(&MQTTRemote::runTask, "mqtt_remote", *_task_size, this, _task_priority, &_task);
+    }
+    return;
+  }
+#endif
+  std::lock_guard<ClientMutex> lock(_client_mutex);
+  handleClient();
+}
+
+#ifdef ESP32
+void MQTTRemote::runTask(void *arg) {
+  auto _this = (MQTTRemote *)arg;
+  while (true) {
+    {
+      std::lock_guard<ClientMutex> lock(_this->_client_mutex);
+      _this->handleClient();
+    }
+    _this->waitForData();
+  }
+}
+
+void MQTTRemote::waitForData() {
+  int fd = -1;
+  {
+    std::lock_guard<ClientMutex> lock(_client_mutex);
+    if (_mqtt_client.connected()) {
+      if (_wifi_client.available() > 0) {
+        // Already read from the socket, but not yet handled.
+        return;
+      }
+      fd = _wifi_client.fd();
+    }
+  }
+  if (fd < 0) {
+    vTaskDelay(pdMS_TO_TICKS(TASK_MAX_WAIT_MS));
+    return;
+  }
+
+  fd_set read_fds;
+  FD_ZERO(&read_fds);
+  FD_SET(fd, &read_fds);
+  timeval timeout = {};
+  timeout.tv_usec = TASK_MAX_WAIT_MS * 1000;
+  if (select(fd + 1, &read_fds, nullptr, nullptr, &timeout) < 0) {
+    // Socket closed by another task, the client will notice on the next loop.
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+}
+#endif
+
+void MQTTRemote::handleClient() {
+  if (_stopped) {
+    return;
+  }
   auto now = millis();
   auto connected = _mqtt_client.connected();
+  if (!connected && _was_connected) {
+    // Before reconnecting, as the keep alive interval is sent when connecting.
+    onKeepAliveDisconnect();
+  }
 
   if (!connected && (now - _last_connection_attempt_timestamp_ms > RETRY_CONNECT_WAIT_MS)) {
+    OperationMemoryScope memory_scope(*this, _connect_memory);
     Serial.print("MQTTRemote: Client not connected. Trying to connect... ");
     setupWill();
     auto r = _mqtt_client.connect(_client_id.c_str(), _username.c_str(), _password.c_str());
     if (r) {
       Serial.println("success!");
+      _connection_count++;
+      _last_sent_ms = millis();
+      _connection_pings = 0;
 
       // And publish that we are now online.
       publishMessageVerbose(_client_id + "/status", "online", true);
 
-      // Subscribe to all topics.
-      for (const auto &subscription : _subscriptions) {
-        _mqtt_client.subscribe(subscription.first.c_str());
+      // Taken, as failures are added again.
+      std::set<std::string> pending_subscriptions;
+      std::set<std::string> pending_unsubscriptions;
+      pending_subscriptions.swap(_pending_subscriptions);
+      pending_unsubscriptions.swap(_pending_unsubscriptions);
+      if (_mqtt_client.sessionPresent()) {
+        // Broker still has our subscriptions, only subscribe to the ones added since, and unsubscribe from the ones
+        // removed since.
+        Serial.println("MQTTRemote: Session present, skipping resubscribe.");
+        for (const auto &topic : pending_unsubscriptions) {
+          unsubscribeOnBroker(topic);
+        }
+        for (const auto &topic : pending_subscriptions) {
+          subscribeOnBroker(topic);
+        }
+      } else {
+        // Subscribe to all topics.
+        for (const auto &subscription : _subscriptions) {
+          subscribeOnBroker(subscription.first);
+        }
       }
     } else {
       Serial.println(("failed :(, rc=" + std::to_string(_mqtt_client.lastError())).c_str());
@@ -46,16 +250,80 @@ void MQTTRemote::handle() {
   _was_connected = connected;
 }
 
+bool MQTTRemote::flush(unsigned long timeout_ms) {
+  std::lock_guard<ClientMutex> lock(_client_mutex);
+  if (!_mqtt_client.connected()) {
+    return false;
+  }
+#ifdef ESP8266
+  return _wifi_client.flush(timeout_ms);
+#else
+  // WiFiClient::flush() on ESP32 discards received data instead, and lwIP sends the data on its own.
+  return true;
+#endif
+}
+
+bool MQTTRemote::stop(unsigned long timeout_ms) {
+  std::lock_guard<ClientMutex> lock(_client_mutex);
+  if (_stopped) {
+    return true;
+  }
+  _stopped = true;
+  bool flushed = true;
+  if (_mqtt_client.connected()) {
+    Serial.println("MQTTRemote: Stopping, publishing offline status.");
+    _mqtt_client.publish(std::string(_client_id + "/status").c_str(), "offline", true, 1);
+    flushed = flush(timeout_ms);
+    _mqtt_client.disconnect();
+  }
+  if (_on_connection_change && _was_connected) {
+    _on_connection_change(false);
+  }
+  _was_connected = false;
+  return flushed;
+}
+
 bool MQTTRemote::publishMessage(std::string topic, std::string message, bool retain, uint8_t qos) {
+  std::lock_guard<ClientMutex> lock(_client_mutex);
+  OperationMemoryScope memory_scope(*this, _publish_memory);
+  if (_traffic_recorder) {
+    _traffic_recorder({true, micros(), topic, message});
+  }
+  bool delivered_locally = false;
+  if (_local_delivery) {
+    delivered_locally = dispatchMessage(topic, message, micros());
+    if (delivered_locally && !_forward_local_delivery) {
+      return true;
+    }
+  }
+
   if (!connected()) {
+    if (delivered_locally) {
+      return true;
+    }
     Serial.println(("MQTTRemote: Wanted to publish to topic " + topic + ", but no connection to server.").c_str());
     return false;
   }
-  return _mqtt_client.publish(topic.c_str(), message.c_str(), retain, qos);
+  if (delivered_locally) {
+    rememberLocalDelivery(topic, message);
+  }
+  if (shouldCompress(topic, message)) {
+    std::string compressed;
+    if (MQTTCompression::compress(message, compressed)) {
+      message = std::move(compressed);
+    }
+  }
+  if (!_mqtt_client.publish(topic.c_str(), message.c_str(), retain, qos)) {
+    return false;
+  }
+  onMessageSent();
+  return true;
 }
 
 bool MQTTRemote::publishMessageVerbose(std::string topic, std::string message, bool retain, uint8_t qos) {
-  if (!connected()) {
+  std::lock_guard<ClientMutex> lock(_client_mutex);
+  // With local delivery, publishing can succeed while not connected.
+  if (!connected() && !_local_delivery) {
     Serial.println(("MQTTRemote: Wanted to publish to topic " + topic + ", but no connection to server.").c_str());
     return false;
   }
@@ -66,44 +334,434 @@ bool MQTTRemote::publishMessageVerbose(std::string topic, std::string message, b
 }
 
 bool MQTTRemote::subscribe(std::string topic, IMQTTRemote::SubscriptionCallback message_callback) {
-  if (_subscriptions.count(topic) > 0) {
-    Serial.println(("MQTTRemote: Warning: Topic " + topic + " is already subscribed to.").c_str());
-    return false;
+  SubscriptionHandle handle;
+  return subscribe(std::move(topic), std::move(message_callback), handle);
+}
+
+bool MQTTRemote::subscribe(std::string topic, IMQTTRemote::SubscriptionCallback message_callback,
+                           SubscriptionHandle &handle) {
+  std::lock_guard<ClientMutex> lock(_client_mutex);
+  OperationMemoryScope memory_scope(*this, _subscribe_memory);
+  handle = _next_subscription_handle++;
+  if (_next_subscription_handle == 0) {
+    _next_subscription_handle = 1;
+  }
+  auto subscription = _subscriptions.find(topic);
+  if (subscription != _subscriptions.end()) {
+    // Already subscribed on the broker.
+    subscription->second.callbacks.emplace(handle, message_callback);
+    return true;
   }
 
-  _subscriptions.emplace(topic, message_callback);
+  _subscriptions[topic].callbacks.emplace(handle, message_callback);
+  if (hasWildcard(topic)) {
+    _wildcard_subscriptions++;
+  }
+  _pending_unsubscriptions.erase(topic);
 
   if (!connected()) {
     Serial.println("MQTTRemote: Not connected. Will subscribe once connected.");
+    _pending_subscriptions.insert(topic);
     return false;
   }
 
-  return _mqtt_client.subscribe(topic.c_str());
+  return subscribeOnBroker(topic);
+}
+
+bool MQTTRemote::unsubscribe(std::string topic, SubscriptionHandle handle) {
+  std::lock_guard<ClientMutex> lock(_client_mutex);
+  auto subscription = _subscriptions.find(topic);
+  if (subscription == _subscriptions.end() || subscription->second.callbacks.erase(handle) == 0) {
+    return false;
+  }
+  if (!subscription->second.callbacks.empty()) {
+    // Still subscribed for the other callbacks.
+    return true;
+  }
+  return unsubscribe(topic);
 }
 
 bool MQTTRemote::unsubscribe(std::string topic) {
-  _subscriptions.erase(topic);
-  return _mqtt_client.unsubscribe(topic.c_str());
+  std::lock_guard<ClientMutex> lock(_client_mutex);
+  if (_subscriptions.erase(topic) > 0 && hasWildcard(topic)) {
+    _wildcard_subscriptions--;
+  }
+  _pending_subscriptions.erase(topic);
+
+  if (!connected()) {
+    // With a persistent session, the broker would otherwise keep the subscription.
+    Serial.println("MQTTRemote: Not connected. Will unsubscribe once connected.");
+    _pending_unsubscriptions.insert(topic);
+    return false;
+  }
+
+  return unsubscribeOnBroker(topic);
+}
+
+bool MQTTRemote::shouldCompress(const std::string &topic, const std::string &message) {
+  if (_compress_min_size == 0 || message.size() < _compress_min_size) {
+    return false;
+  }
+  for (const auto &prefix : _compress_topic_prefixes) {
+    if (topic.compare(0, prefix.length(), prefix) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool MQTTRemote::subscribeOnBroker(const std::string &topic) {
+  if (_mqtt_client.subscribe(topic.c_str(), _subscription_qos)) {
+    return true;
+  }
+  Serial.println(("MQTTRemote: Failed to subscribe to " + topic + ", will retry on next connect.").c_str());
+  _pending_subscriptions.insert(topic);
+  return false;
+}
+
+bool MQTTRemote::unsubscribeOnBroker(const std::string &topic) {
+  if (_mqtt_client.unsubscribe(topic.c_str())) {
+    return true;
+  }
+  Serial.println(("MQTTRemote: Failed to unsubscribe from " + topic + ", will retry on next connect.").c_str());
+  _pending_unsubscriptions.insert(topic);
+  return false;
 }
 
 void MQTTRemote::onMessage(MQTTClient *client, char topic_cstr[], char message_cstr[], int message_size) {
+  OperationMemoryScope memory_scope(*this, _dispatch_memory);
+  auto received_us = micros();
   std::string topic = std::string(topic_cstr);
   if (_receive_verbose) {
     Serial.print(("Received message with topic " + topic).c_str());
   }
-  if (auto subscription = _subscriptions.find(topic); subscription != _subscriptions.end()) {
-    if (_receive_verbose) {
-      Serial.print(" (callback found) ");
+  std::string message = std::string(message_cstr, message_size);
+  if (_decompress && MQTTCompression::isCompressed(message)) {
+    std::string decompressed;
+    if (MQTTCompression::decompress(message, decompressed)) {
+      message = std::move(decompressed);
+    } else {
+      Serial.println(("MQTTRemote: Warning: Failed to decompress message with topic " + topic + ", delivering as is.")
+                         .c_str());
     }
-    subscription->second(topic_cstr, message_cstr);
-  } else {
+  }
+  if (_local_delivery && isLocalEcho(topic, message)) {
     if (_receive_verbose) {
-      Serial.print(" (NO callback found) ");
+      Serial.println(" (echo of locally delivered message, ignored)");
     }
+    return;
+  }
+  if (_traffic_recorder) {
+    _traffic_recorder({false, received_us, topic, message});
+  }
+  bool found = dispatchMessage(topic, message, received_us);
+  if (_receive_verbose) {
+    Serial.print(found ? " (callback found) " : " (NO callback found) ");
   }
   if (_receive_verbose) {
     Serial.println(("and size: " + std::to_string(message_size)).c_str());
   }
 }
 
+bool MQTTRemote::dispatchMessage(const std::string &topic, const std::string &message, unsigned long received_us) {
+  bool found = false;
+  auto subscription = _subscriptions.find(topic);
+  if (subscription != _subscriptions.end()) {
+    found = true;
+    if (subscription->second.callbacks.size() == 1) {
+      auto start_us = micros();
+      subscription->second.callbacks.begin()->second(topic, message);
+      recordDispatch(topic, topic, received_us, start_us, micros());
+    } else {
+      // Copy, as a callback might subscribe or unsubscribe.
+      auto callbacks = subscription->second.callbacks;
+      for (const auto &callback : callbacks) {
+        auto start_us = micros();
+        callback.second(topic, message);
+        recordDispatch(topic, topic, received_us, start_us, micros());
+      }
+    }
+  }
+
+  if (_wildcard_subscriptions > 0) {
+    // Copy, as a callback might subscribe or unsubscribe.
+    std::vector<std::pair<std::string, SubscriptionCallback>> callbacks;
+    for (const auto &subscription : _subscriptions) {
+      if (hasWildcard(subscription.first) && topicMatchesFilter(subscription.first, topic)) {
+        for (const auto &callback : subscription.second.callbacks) {
+          callbacks.emplace_back(subscription.first, callback.second);
+        }
+      }
+    }
+    for (const auto &callback : callbacks) {
+      found = true;
+      auto start_us = micros();
+      callback.second(topic, message);
+      recordDispatch(callback.first, topic, received_us, start_us, micros());
+    }
+  }
+  return found;
+}
+
+void MQTTRemote::recordDispatch(const std::string &topic_filter, const std::string &topic, unsigned long received_us,
+                                unsigned long start_us, unsigned long end_us) {
+  uint32_t duration_us = end_us - start_us;
+  bool slow = _slow_handler_threshold_us > 0 && duration_us > _slow_handler_threshold_us;
+  if (slow) {
+    Serial.println(("MQTTRemote: Warning: Slow callback for " + topic_filter + ": " + std::to_string(duration_us) +
+                    " us for topic " + topic)
+                       .c_str());
+  }
+
+  // The callback might have unsubscribed.
+  auto subscription = _subscriptions.find(topic_filter);
+  if (subscription != _subscriptions.end()) {
+    auto &stats = subscription->second.stats;
+    stats.count++;
+    stats.slow += slow ? 1 : 0;
+    stats.max_us = std::max(stats.max_us, duration_us);
+    stats.total_us += duration_us;
+    size_t bucket = 0;
+    while (bucket < stats.histogram.size() - 1 && (1u << bucket) <= duration_us) {
+      bucket++;
+    }
+    stats.histogram[bucket]++;
+  }
+
+  if (_dispatch_trace) {
+    _dispatch_trace({topic_filter, topic, received_us, start_us, end_us});
+  }
+}
+
+MQTTRemote::DispatchStats MQTTRemote::dispatchStats(const std::string &topic_filter) {
+  std::lock_guard<ClientMutex> lock(_client_mutex);
+  auto subscription = _subscriptions.find(topic_filter);
+  if (subscription != _subscriptions.end()) {
+    return subscription->second.stats;
+  }
+  return {};
+}
+
+std::string MQTTRemote::toChromeTraceEvent(const DispatchTrace &trace) {
+  return "{\"name\":\"" + escapeJson(trace.topic_filter) + "\",\"cat\":\"dispatch\",\"ph\":\"X\",\"ts\":" +
+         std::to_string(trace.start_us) + ",\"dur\":" + std::to_string(trace.end_us - trace.start_us) +
+         ",\"pid\":0,\"tid\":0,\"args\":{\"topic\":\"" + escapeJson(trace.topic) +
+         "\",\"queued_us\":" + std::to_string(trace.start_us - trace.received_us) + "}}";
+}
+
+void MQTTRemote::onMessageSent() {
+  auto now_ms = millis();
+  auto pings = pendingPings(now_ms);
+  _pings += pings;
+  _connection_pings += pings;
+  _last_sent_ms = now_ms;
+}
+
+void MQTTRemote::onKeepAliveDisconnect() {
+  auto now_ms = millis();
+  auto idle_pings = pendingPings(now_ms);
+  _pings += idle_pings;
+  auto connection_pings = _connection_pings;
+  _connection_pings = 0;
+  expireKeepAliveFailure(now_ms);
+  if (_keep_alive_max_s <= _keep_alive_working_s && _keep_alive_s == _keep_alive_working_s) {
+    // Not adaptive, or already using the longest interval.
+    return;
+  }
+
+  auto previous_s = _keep_alive_s;
+  if (idle_pings == 0 && connection_pings >= KEEP_ALIVE_PROBE_PINGS) {
+    // Survived enough idle pings, and lost for another reason than being idle, so try a longer interval. A connection
+    // is never dropped just to try one, as reconnecting costs a TLS handshake, lost messages and resubscribing.
+    _keep_alive_idle_failures = 0;
+    _keep_alive_working_s = std::max(_keep_alive_working_s, _keep_alive_s);
+    _keep_alive_s = nextKeepAlive(_keep_alive_working_s);
+  } else if (idle_pings > 0 && _keep_alive_s > _keep_alive_working_s &&
+             ++_keep_alive_idle_failures >= KEEP_ALIVE_FAILURES) {
+    // Lost while idle after a ping several times in a row, likely dropped by a NAT router or the broker, so the
+    // interval is too long. A single loss might as well be a WiFi glitch, so the interval is tried again until then.
+    _keep_alive_idle_failures = 0;
+    _keep_alive_failed_s = _keep_alive_failed_s ? std::min(_keep_alive_failed_s, _keep_alive_s) : _keep_alive_s;
+    _keep_alive_failed_at_ms = now_ms;
+    _keep_alive_s = _keep_alive_working_s;
+  }
+  if (_keep_alive_s != previous_s) {
+    Serial.println(("MQTTRemote: Keep alive interval " + std::to_string(_keep_alive_s) + " s for next connection.")
+                       .c_str());
+    _mqtt_client.setKeepAlive(_keep_alive_s);
+  }
+}
+
+uint32_t MQTTRemote::pendingPings(unsigned long now_ms) {
+  if (_keep_alive_s == 0) {
+    return 0;
+  }
+  // arduino-mqtt pings after one keep alive interval without sending anything.
+  return (now_ms - _last_sent_ms) / (_keep_alive_s * 1000);
+}
+
+uint32_t MQTTRemote::nextKeepAlive(uint32_t working_s) {
+  if (_keep_alive_failed_s == 0) {
+    return std::min(working_s * 2, _keep_alive_max_s);
+  }
+  // Halfway between the longest interval that worked and the shortest that did not, until they meet.
+  return std::max(working_s, (working_s + _keep_alive_failed_s) / 2);
+}
+
+void MQTTRemote::expireKeepAliveFailure(unsigned long now_ms) {
+  if (_keep_alive_failed_s != 0 && now_ms - _keep_alive_failed_at_ms >= KEEP_ALIVE_FAILURE_EXPIRY_MS) {
+    Serial.println(
+        ("MQTTRemote: Keep alive interval " + std::to_string(_keep_alive_failed_s) + " s can be tried again.").c_str());
+    _keep_alive_failed_s = 0;
+  }
+}
+
+MQTTRemote::KeepAliveStats MQTTRemote::keepAliveStats() {
+  std::lock_guard<ClientMutex> lock(_client_mutex);
+  auto pending = _mqtt_client.connected() ? pendingPings(millis()) : 0;
+  return {_keep_alive_s, _keep_alive_working_s, _keep_alive_failed_s, _pings + pending};
+}
+
+MQTTRemote::MemoryReport MQTTRemote::memoryReport() {
+  std::lock_guard<ClientMutex> lock(_client_mutex);
+  MemoryReport report = {};
+#ifdef ESP32
+  if (_task != nullptr) {
+    // In ESP-IDF, the high water mark is in bytes.
+    report.task_free_stack_min_bytes = uxTaskGetStackHighWaterMark(_task);
+  }
+  report.free_heap_min_bytes = esp_get_minimum_free_heap_size();
+#endif
+  report.free_heap_bytes = freeHeap();
+  report.subscriptions = _subscriptions.size();
+  report.subscriptions_bytes = subscriptionsBytes();
+  report.subscribe = _subscribe_memory;
+  report.publish = _publish_memory;
+  report.dispatch = _dispatch_memory;
+  report.connect = _connect_memory;
+  return report;
+}
+
+bool MQTTRemote::checkMemoryBudget(const MemoryBudget &budget) {
+  auto report = memoryReport();
+  bool within_budget = true;
+#ifdef ESP32
+  if (_task != nullptr && report.task_free_stack_min_bytes < budget.task_free_stack_min_bytes) {
+    Serial.println(("MQTTRemote: Task free stack " + std::to_string(report.task_free_stack_min_bytes) +
+                    " bytes, budget " + std::to_string(budget.task_free_stack_min_bytes) + " bytes.")
+                       .c_str());
+    within_budget = false;
+  }
+  if (report.free_heap_min_bytes < budget.free_heap_min_bytes) {
+    Serial.println(("MQTTRemote: Minimum free heap " + std::to_string(report.free_heap_min_bytes) +
+                    " bytes, budget " + std::to_string(budget.free_heap_min_bytes) + " bytes.")
+                       .c_str());
+    within_budget = false;
+  }
+#endif
+  size_t subscription_bytes = report.subscriptions > 0 ? report.subscriptions_bytes / report.subscriptions : 0;
+  if (budget.subscription_max_bytes > 0 && subscription_bytes > budget.subscription_max_bytes) {
+    Serial.println(("MQTTRemote: Heap per subscription " + std::to_string(subscription_bytes) + " bytes, budget " +
+                    std::to_string(budget.subscription_max_bytes) + " bytes.")
+                       .c_str());
+    within_budget = false;
+  }
+  struct {
+    const char *name;
+    const OperationMemory &operation;
+    int32_t max_bytes;
+  } operations[] = {{"subscribe()", report.subscribe, budget.subscribe_max_bytes},
+                    {"publishMessage()", report.publish, budget.publish_max_bytes},
+                    {"Dispatch", report.dispatch, budget.dispatch_max_bytes},
+                    {"Connect", report.connect, budget.connect_max_bytes}};
+  for (const auto &operation : operations) {
+    if (operation.max_bytes > 0 && operation.operation.count > 0 &&
+        operation.operation.max_bytes > operation.max_bytes) {
+      Serial.println(("MQTTRemote: " + std::string(operation.name) + " used up to " +
+                      std::to_string(operation.operation.max_bytes) + " bytes of heap, budget " +
+                      std::to_string(operation.max_bytes) + " bytes.")
+                         .c_str());
+      within_budget = false;
+    }
+  }
+  return within_budget;
+}
+
+size_t MQTTRemote::subscriptionsBytes() {
+  // Estimated from what the containers allocate, as the heap used by a single allocation is not known.
+  const size_t inline_capacity = std::string().capacity();
+  size_t bytes = 0;
+  for (const auto &subscription : _subscriptions) {
+    bytes += MAP_NODE_OVERHEAD_BYTES + sizeof(subscription);
+    if (subscription.first.capacity() > inline_capacity) {
+      bytes += subscription.first.capacity() + 1;
+    }
+    bytes += subscription.second.callbacks.size() *
+             (MAP_NODE_OVERHEAD_BYTES + sizeof(std::pair<const SubscriptionHandle, SubscriptionCallback>));
+  }
+  return bytes;
+}
+
+MQTTRemote::OperationMemoryScope::OperationMemoryScope(MQTTRemote &remote, OperationMemory &operation)
+    : _remote(remote), _operation(operation) {
+  if (_remote._track_operation_memory) {
+    _free_heap = freeHeap();
+  }
+}
+
+MQTTRemote::OperationMemoryScope::~OperationMemoryScope() {
+  if (!_remote._track_operation_memory) {
+    return;
+  }
+  int32_t bytes = (int32_t)(_free_heap - freeHeap());
+  _operation.max_bytes = _operation.count == 0 ? bytes : std::max(_operation.max_bytes, bytes);
+  _operation.last_bytes = bytes;
+  _operation.total_bytes += bytes;
+  _operation.count++;
+}
+
 void MQTTRemote::setupWill() { _mqtt_client.setWill(std::string(_client_id + "/status").c_str(), "offline", true, 0); }
+
+void MQTTRemote::rememberLocalDelivery(const std::string &topic, const std::string &message) {
+  _local_echoes[_next_local_echo] = {hashMessage(topic, message), millis(), true};
+  _next_local_echo = (_next_local_echo + 1) % _local_echoes.size();
+}
+
+bool MQTTRemote::isLocalEcho(const std::string &topic, const std::string &message) {
+  auto hash = hashMessage(topic, message);
+  auto now = millis();
+  for (auto &echo : _local_echoes) {
+    if (echo.expected && echo.hash == hash && now - echo.published_ms < LOCAL_ECHO_TIMEOUT_MS) {
+      // Each echo is only expected once.
+      echo.expected = false;
+      return true;
+    }
+  }
+  return false;
+}
+
+MQTTRemote::ReplayStats MQTTRemote::replay(std::string capture, float speed) {
+  ReplayStats stats = {};
+  MQTTCaptureReader reader(std::move(capture));
+  MQTTCaptureRecord record;
+  auto start_us = micros();
+  while (reader.next(record)) {
+    if (record.published) {
+      continue;
+    }
+    if (speed > 0) {
+      long wait_us = (long)(record.timestamp_us / speed) - (long)(micros() - start_us);
+      if (wait_us >= 1000) {
+        delay(wait_us / 1000);
+      } else if (wait_us > 0) {
+        delayMicroseconds(wait_us);
+      }
+    }
+    std::lock_guard<ClientMutex> lock(_client_mutex);
+    dispatchMessage(record.topic, record.message, micros());
+    stats.messages++;
+  }
+  stats.duration_us = micros() - start_us;
+  stats.failed = reader.failed();
+  return stats;
+}
@@ -2,12 +2,21 @@
 #define __MQTT_REMOTE_H__
 
 #include "IMQTTRemote.h"
+#include "MQTTCapture.h"
+#include "MQTTCompression.h"
 #include <MQTT.h>
+#include <array>
 #include <functional>
 #include <map>
+#include <mutex>
+#include <optional>
+#include <set>
 #include <string>
+#include <vector>
 #ifdef ESP32
 #include <WiFi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #elif ESP8266
 #include <ESP8266WiFi.h>
 #elif defined(ARDUINO_SAMD_MKRWIFI1010)
@@ -22,6 +31,126 @@
  */
 class MQTTRemote : public IMQTTRemote {
 public:
+  /**
+   * Keep alive statistics, see keepAliveStats().
+   */
+  struct KeepAliveStats {
+    // Keep alive interval, in seconds, of the current connection, or of the next one if not connected.
+    uint32_t interval_s;
+    // Longest interval that has worked, and shortest one that has not in the last day (0 if none), in seconds. See
+    // Configuration::keep_alive_max_s.
+    uint32_t longest_working_s;
+    uint32_t shortest_failed_s;
+    // Estimated number of pings (PINGREQ) sent, from the time spent connected without sending anything.
+    uint32_t pings;
+  };
+
+  /**
+   * Dispatch statistics for one subscription, see dispatchStats().
+   */
+  struct DispatchStats {
+    // Number of messages dispatched to the subscription callback.
+    uint32_t count;
+    // Number of dispatches that took longer than Configuration::slow_handler_threshold_us.
+    uint32_t slow;
+    // Maximum and total time, in microseconds, spent in the callback.
+    uint32_t max_us;
+    uint64_t total_us;
+    // Histogram of the time spent in the callback. histogram[i] counts durations in [2^(i-1), 2^i) microseconds.
+    // histogram[0] counts durations below 1 µs, and the last bucket also counts everything longer.
+    std::array<uint32_t, 20> histogram;
+  };
+
+  /**
+   * Trace of one dispatch of a message to a subscription callback, see Configuration::dispatch_trace.
+   * Timestamps are in microseconds, from micros().
+   */
+  struct DispatchTrace {
+    const std::string &topic_filter;
+    const std::string &topic;
+    // When the message was received from the MQTT client.
+    unsigned long received_us;
+    // When the callback was invoked and when it returned.
+    unsigned long start_us;
+    unsigned long end_us;
+  };
+
+  /**
+   * A received or published message, see Configuration::traffic_recorder.
+   */
+  struct TrafficRecord {
+    // True for a published message, false for a received message.
+    bool published;
+    // When the message was received or published, in microseconds, from micros().
+    unsigned long timestamp_us;
+    const std::string &topic;
+    const std::string &message;
+  };
+
+  /**
+   * Heap used by one kind of operation, see MemoryReport and Configuration::track_operation_memory.
+   */
+  struct OperationMemory {
+    // Number of operations measured.
+    uint32_t count;
+    // Heap used by the operation, in bytes, from the free heap before and after it. Positive for memory kept, like
+    // for a new subscription. Includes allocations by other tasks meanwhile, so measure without other activity.
+    int32_t last_bytes;
+    int32_t max_bytes;
+    int64_t total_bytes;
+  };
+
+  /**
+   * Memory usage, see memoryReport().
+   */
+  struct MemoryReport {
+    // ESP32 only, with Configuration::task_size set, otherwise 0. Minimum amount of free stack, in bytes, the MQTT
+    // task has had since it was started (the high water mark).
+    uint32_t task_free_stack_min_bytes;
+    // ESP32 and ESP8266 only, otherwise 0. Currently free heap, in bytes.
+    uint32_t free_heap_bytes;
+    // ESP32 only, otherwise 0. Minimum free heap, in bytes, since boot.
+    uint32_t free_heap_min_bytes;
+    // Number of subscriptions.
+    size_t subscriptions;
+    // Estimated heap, in bytes, used by the subscriptions: table entries, topics, callbacks and dispatch statistics,
+    // but not what the callbacks capture. Divide by subscriptions for the cost of one subscription.
+    size_t subscriptions_bytes;
+    // Heap used by subscribe(), publishMessage(), dispatching a received message to the callbacks, and connection
+    // attempts (including subscribing again). Only if Configuration::track_operation_memory is set.
+    OperationMemory subscribe;
+    OperationMemory publish;
+    OperationMemory dispatch;
+    OperationMemory connect;
+  };
+
+  /**
+   * Memory budget, see checkMemoryBudget(). Set a value to 0 to not check it.
+   */
+  struct MemoryBudget {
+    uint32_t task_free_stack_min_bytes = 0;
+    uint32_t free_heap_min_bytes = 0;
+    // Maximum heap, in bytes, used per subscription, see MemoryReport::subscriptions_bytes.
+    size_t subscription_max_bytes = 0;
+    // Maximum heap, in bytes, used by one operation, see MemoryReport. Needs Configuration::track_operation_memory.
+    int32_t subscribe_max_bytes = 0;
+    int32_t publish_max_bytes = 0;
+    int32_t dispatch_max_bytes = 0;
+    int32_t connect_max_bytes = 0;
+  };
+
+  /**
+   * Result of replay().
+   */
+  struct ReplayStats {
+    // Number of received messages replayed.
+    uint32_t messages;
+    // Time, in microseconds, spent replaying.
+    int64_t duration_us;
+    // True if the capture is not valid. Messages before the invalid part are still replayed.
+    bool failed;
+  };
+
   /**
    * Additional configuration where most user can go with defaults.
    */
@@ -38,11 +167,131 @@ public:
      */
     uint32_t keep_alive_s = 10;
 
+    /**
+     * Adaptive keep alive: the longest keep alive interval, in seconds, to use. If larger than keep_alive_s, the
+     * interval starts at keep_alive_s and is raised up to the longest interval that the network path (like a NAT
+     * router dropping idle connections) and the broker tolerate. The interval is sent when connecting, so a longer one
+     * is only tried on the next reconnect after a connection has survived a few pings while idle. A connection is
+     * never dropped just to try a longer interval. When connections are lost while idle a few times in a row, the
+     * interval goes back to the longest one that worked, and longer ones are not tried again for a day.
+     * 0 (default) to always use keep_alive_s. See keepAliveStats().
+     * Pings are only sent after a keep alive interval without sending anything, so a device publishing more often
+     * than that sends no pings at all.
+     */
+    uint32_t keep_alive_max_s = 0;
+
     /**
      * if true, will print on Serial on message received. Publish verbosity is controlled by the
      * which publish method that is used. Connection information on setup will always be printed out.
      */
     bool receive_verbose = false;
+
+    /**
+     * If false, ask the broker to keep the session (subscriptions and queued QoS 1/2 messages) when disconnected.
+     * On reconnect, if the broker reports that the session is still present, the subscriptions are not sent again
+     * (except for those added while disconnected), and any QoS 1/2 messages sent while offline are delivered.
+     * This requires a stable client ID.
+     *
+     * If true (default), every connection starts with a new clean session.
+     */
+    bool clean_session = true;
+
+    /**
+     * QoS to use for subscriptions (0, 1 or 2). Use 1 together with clean_session = false for the broker to queue
+     * messages while the device is offline.
+     */
+    uint8_t subscription_qos = 0;
+
+    /**
+     * If larger than 0, a warning is printed for every subscription callback that takes longer than this, in
+     * microseconds. Such dispatches are also counted in DispatchStats::slow. As callbacks run from handle(), a slow
+     * callback delays all other messages.
+     *
+     * If 0 (default), no warnings are printed.
+     */
+    uint32_t slow_handler_threshold_us = 0;
+
+    /**
+     * ESP32 and ESP8266 only. If true, the heap used by subscribe(), publishMessage(), dispatching and connecting is
+     * measured, from the free heap before and after each operation. See memoryReport().
+     */
+    bool track_operation_memory = false;
+
+    /**
+     * Optional hook invoked after every subscription callback with the timestamps of the dispatch. Should be fast,
+     * for example storing the trace in a buffer. Use toChromeTraceEvent() to convert a trace to a Chrome
+     * trace/Perfetto compatible event.
+     */
+    std::function<void(const DispatchTrace &)> dispatch_trace;
+
+    /**
+     * Optional hook invoked for every received message before it is delivered to the subscription callbacks, and for
+     * every message given to publishMessage(). Use with MQTTCaptureWriter to record traffic, for example during an
+     * incident, that can be replayed later using replay(). Should be fast.
+     */
+    std::function<void(const TrafficRecord &)> traffic_recorder;
+
+    /**
+     * If true, publishMessage() to a topic matching a subscription of this MQTTRemote invokes the subscription
+     * callbacks directly, without a round trip to the broker. This also works while disconnected.
+     * Use this when modules on the same device talk to each other over MQTT.
+     * The echo of such a message from the broker is recognized by topic and payload for 5 seconds after publishing,
+     * and is not delivered a second time.
+     * WARNING: a message from another client with the same topic and payload as one published locally within these 5
+     * seconds is taken for the echo and dropped. Set forward_local_delivery to false if identical messages from other
+     * clients must be received.
+     *
+     * If false (default), all messages are delivered through the broker.
+     */
+    bool local_delivery = false;
+
+    /**
+     * When using local_delivery, if messages delivered locally should also be published to the broker, for other
+     * clients to receive. If false, messages matching a local subscription are only delivered locally.
+     */
+    bool forward_local_delivery = true;
+
+    /**
+     * If larger than 0, publishMessage() compresses messages of at least this many bytes using MQTTCompression, if
+     * that makes them smaller, for topics starting with one of compress_topic_prefixes. Use for large and repetitive
+     * messages like diagnostic dumps, to reduce traffic and the needed buffer_size. Compressed messages can only
+     * be read by subscribers that decompress them, like this library with decompress set to true.
+     *
+     * If 0 (default), messages are never compressed.
+     */
+    size_t compress_min_size = 0;
+
+    /**
+     * Topic prefixes to compress messages for, see compress_min_size. Only list topics read by subscribers that
+     * decompress them, never topics read by other software, like Home Assistant discovery (homeassistant/).
+     *
+     * If empty (default), messages are never compressed.
+     */
+    std::vector<std::string> compress_topic_prefixes = {};
+
+    /**
+     * If true, compressed messages (see MQTTCompression) are decompressed before being delivered to the subscription
+     * callbacks. Messages that are not compressed are delivered as is.
+     */
+    bool decompress = false;
+
+#ifdef ESP32
+    /**
+     * ESP32 only. If set, the MQTT client runs in its own FreeRTOS task with this stack size, in bytes, instead of in
+     * handle(). The task wakes up as soon as data arrives on the socket, so receive latency and keep alive no longer
+     * depend on how often loop() runs, for example with long delay() calls. Subscription callbacks and the connection
+     * change callback are then invoked from this task. Publishing and subscribing from loop() or other tasks is safe.
+     * Call handle() once, for example from setup(), to start the task. Later calls to handle() do nothing.
+     *
+     * If not set (default), handle() must be called from loop().
+     */
+    std::optional<uint32_t> task_size = std::nullopt;
+
+    /**
+     * Priority of the task when task_size is set. The Arduino loop() runs at priority 1.
+     */
+    UBaseType_t task_priority = 1;
+#endif
   };
 
   /**
@@ -78,7 +327,8 @@ public:
              Configuration configuration);
 
   /**
-   * Call from Arduino loop() function in main.
+   * Call from Arduino loop() function in main. When using Configuration::task_size (ESP32 only), this starts the task
+   * instead and only has to be called once.
    */
   void handle();
 
@@ -89,6 +339,24 @@ public:
    */
   void setOnConnectionChange(std::function<void(bool connected)> callback = {}) { _on_connection_change = callback; };
 
+  /**
+   * @brief Wait until all published messages have left. Publishing is synchronous, where QoS 1/2 publishes wait for
+   * the acknowledgement from the broker, so this only waits for data still in the TCP send buffer (ESP8266). Use before
+   * deep sleep instead of guessing a delay.
+   * @param timeout_ms maximum time to wait.
+   * @return true if all messages have left, false on timeout or if not connected.
+   */
+  bool flush(unsigned long timeout_ms);
+
+  /**
+   * @brief Gracefully disconnect, for example before deep sleep. Publishes "offline" on the status topic (retained, QoS
+   * 1), waits for published messages to leave (see flush()), and then sends DISCONNECT. As the disconnect is explicit,
+   * the broker does not publish the last will. handle() does not connect again afterwards.
+   * @param timeout_ms maximum time to wait for published messages to leave.
+   * @return true if all messages left before disconnecting, false on timeout.
+   */
+  bool stop(unsigned long timeout_ms);
+
   /**
    * @brief Publish a message.
    *
@@ -97,7 +365,8 @@ public:
    * constructor.
    * @param retain True to set this message as retained.
    * @param qos quality of service for published message (0 (default), 1 or 2)
-   * @returns true on success, or false on failure.
+   * @returns true on success, or false on failure. When using Configuration::local_delivery, also true if delivered
+   * to a local subscription, even if not connected.
    */
   bool publishMessage(std::string topic, std::string message, bool retain = false, uint8_t qos = 0) override;
 
@@ -109,29 +378,111 @@ public:
   /**
    * @brief returns if there is a connection to the MQTT server.
    */
-  bool connected() override { return _mqtt_client.connected(); }
+  bool connected() override {
+    std::lock_guard<ClientMutex> lock(_client_mutex);
+    return _mqtt_client.connected();
+  }
+
+  /**
+   * @brief returns the number of times a connection to the MQTT server has been established.
+   */
+  uint32_t connectionCount() override {
+    std::lock_guard<ClientMutex> lock(_client_mutex);
+    return _connection_count;
+  }
+
+  /**
+   * @brief returns true if the broker reported that a previous session was still present on the last connect.
+   * Can only be true if Configuration::clean_session is false.
+   */
+  bool sessionPresent() {
+    std::lock_guard<ClientMutex> lock(_client_mutex);
+    return _mqtt_client.sessionPresent();
+  }
 
   /**
    * @brief Subscribe to a topic. The callback will be invoked on every new message.
-   * There can only be one callback per topic. If trying to subscribe to an already subscribe topic, it will be ignored.
+   * Several callbacks can subscribe to the same topic. Only the first one results in a subscription on the broker,
+   * the others are added locally. A retained message is therefore only received by the callbacks already subscribed
+   * when it arrives.
+   * The topic can be a topic filter with + and # wildcards, in which case the callback is invoked with the actual
+   * topic of each message. If a message matches several subscriptions, all of them are invoked.
    * Don't do heavy operations in the callback or delays as this will block the MQTT callback.
    *
    * Can be called before being connected. All subscriptions will be (re-)subscribed to once a connection is
    * (re-)established.
    *
    * @param message_callback a message callback with the topic and the message. The topic is repeated for convinience,
-   * but it will always be for the subscribed topic.
+   * and will be the subscribed topic unless using wildcards.
    * @return true if an subcription was successul. Will return false if there is no active MQTT connection. In this
-   * case, the subscription will be performed once connected. Will retun false if this subscription is already
-   * subscribed to.
+   * case, the subscription will be performed once connected. Will return true if a callback was added to an already
+   * subscribed topic.
    */
   bool subscribe(std::string topic, IMQTTRemote::SubscriptionCallback message_callback) override;
 
   /**
-   * @brief Unsubscribe a topic.
+   * @brief Same as subscribe() above, but also sets handle to identify this callback, see unsubscribe(topic, handle).
+   */
+  bool subscribe(std::string topic, IMQTTRemote::SubscriptionCallback message_callback,
+                 SubscriptionHandle &handle) override;
+
+  /**
+   * @brief Unsubscribe a topic. Removes all callbacks for the topic.
+   * @return true if unsubscribed on the broker. If not connected, returns false and unsubscribes on the broker once
+   * connected, if the session is still present.
    */
   bool unsubscribe(std::string topic) override;
 
+  /**
+   * @brief Remove only the callback identified by handle, see subscribe(). Unsubscribes on the broker once the last
+   * callback for the topic has been removed.
+   * @return false if there is no such callback. true if other callbacks remain for the topic, otherwise same as for
+   * unsubscribe(topic).
+   */
+  bool unsubscribe(std::string topic, SubscriptionHandle handle) override;
+
+  /**
+   * @brief returns the keep alive interval and the estimated number of pings sent, see
+   * Configuration::keep_alive_max_s.
+   */
+  KeepAliveStats keepAliveStats();
+
+  /**
+   * @brief returns a report of the current memory usage, like the free heap and the heap used by the subscriptions.
+   */
+  MemoryReport memoryReport();
+
+  /**
+   * @brief checks the current memory usage against a budget. Prints an error for each value over budget.
+   * Useful in tests running on target to catch memory regressions. This is a runtime check, it cannot fail a build.
+   * @return true if within budget.
+   */
+  bool checkMemoryBudget(const MemoryBudget &budget);
+
+  /**
+   * @brief returns the dispatch statistics for the subscription for topic_filter, as given to subscribe(). Returns
+   * all zeros if there is no such subscription.
+   */
+  DispatchStats dispatchStats(const std::string &topic_filter);
+
+  /**
+   * @brief formats a dispatch trace as a Chrome trace event (complete event, "ph":"X"), that can be loaded in
+   * chrome://tracing or Perfetto when put in a JSON array.
+   */
+  static std::string toChromeTraceEvent(const DispatchTrace &trace);
+
+  /**
+   * @brief Replays the received messages in a capture written by MQTTCaptureWriter, delivering them to the
+   * subscription callbacks as if received from the broker. Published messages in the capture are skipped. Use this to
+   * benchmark the subscription callbacks with real traffic, using dispatchStats() or Configuration::dispatch_trace for
+   * the time spent in each callback.
+   *
+   * @param capture the capture to replay. Move the capture in to avoid copying it.
+   * @param speed 1 to replay at the recorded pace, 2 for twice as fast and so on. 0 (default) to replay as fast as
+   * possible.
+   */
+  ReplayStats replay(std::string capture, float speed = 0);
+
   /**
    * @brief The client ID for this device. This is used for the last will / status
    * topic.Example, if this is "esp_now_router", then the status/last will topic will be "esp_now_router/status". This
@@ -140,8 +491,63 @@ public:
   std::string &clientId() override { return _client_id; }
 
 private:
+#ifdef ESP32
+  // The client might be used both from the task (see Configuration::task_size) and from loop(). Recursive, as
+  // callbacks invoked with the mutex held can publish and subscribe.
+  using ClientMutex = std::recursive_mutex;
+#else
+  // Single threaded, no locking needed.
+  struct ClientMutex {
+    void lock() {}
+    void unlock() {}
+  };
+#endif
+
+  struct LocalEcho {
+    uint32_t hash;
+    unsigned long published_ms;
+    bool expected;
+  };
+
+  struct Subscription {
+    // By handle, so in the order subscribed.
+    std::map<SubscriptionHandle, SubscriptionCallback> callbacks;
+    DispatchStats stats;
+  };
+
+  void handleClient();
+#ifdef ESP32
+  static void runTask(void *arg);
+  void waitForData();
+#endif
   void onMessage(MQTTClient *client, char topic_cstr[], char message_cstr[], int message_size);
   void setupWill();
+  bool shouldCompress(const std::string &topic, const std::string &message);
+  bool subscribeOnBroker(const std::string &topic);
+  bool unsubscribeOnBroker(const std::string &topic);
+  void onMessageSent();
+  void onKeepAliveDisconnect();
+  uint32_t pendingPings(unsigned long now_ms);
+  // Measures the heap used from construction to destruction, if Configuration::track_operation_memory.
+  class OperationMemoryScope {
+  public:
+    OperationMemoryScope(MQTTRemote &remote, OperationMemory &operation);
+    ~OperationMemoryScope();
+
+  private:
+    MQTTRemote &_remote;
+    OperationMemory &_operation;
+    uint32_t _free_heap = 0;
+  };
+  size_t subscriptionsBytes();
+  // Next interval to try, if working_s is the longest one that has worked.
+  uint32_t nextKeepAlive(uint32_t working_s);
+  void expireKeepAliveFailure(unsigned long now_ms);
+  bool dispatchMessage(const std::string &topic, const std::string &message, unsigned long received_us);
+  void rememberLocalDelivery(const std::string &topic, const std::string &message);
+  bool isLocalEcho(const std::string &topic, const std::string &message);
+  void recordDispatch(const std::string &topic_filter, const std::string &topic, unsigned long received_us,
+                      unsigned long start_us, unsigned long end_us);
 
 private:
   std::string _client_id;
@@ -149,12 +555,55 @@ private:
   std::string _username;
   std::string _password;
   bool _receive_verbose;
+  uint8_t _subscription_qos;
   WiFiClient _wifi_client;
   MQTTClient _mqtt_client;
   bool _was_connected = false;
+  uint32_t _connection_count = 0;
+  bool _stopped = false;
+  ClientMutex _client_mutex;
+#ifdef ESP32
+  std::optional<uint32_t> _task_size;
+  UBaseType_t _task_priority;
+  TaskHandle_t _task = nullptr;
+#endif
   std::function<void(bool)> _on_connection_change;
-  std::map<std::string, SubscriptionCallback> _subscriptions;
+  uint32_t _slow_handler_threshold_us;
+  std::function<void(const DispatchTrace &)> _dispatch_trace;
+  std::function<void(const TrafficRecord &)> _traffic_recorder;
+  std::map<std::string, Subscription> _subscriptions;
+  // Number of subscriptions in _subscriptions with + or # wildcards.
+  size_t _wildcard_subscriptions = 0;
+  SubscriptionHandle _next_subscription_handle = 1;
+  // Subscriptions not yet sent to the broker. Used to only send these on reconnect when the session is present.
+  std::set<std::string> _pending_subscriptions;
+  // Unsubscriptions not yet sent to the broker, sent on reconnect when the session is present.
+  std::set<std::string> _pending_unsubscriptions;
+  bool _local_delivery;
+  bool _forward_local_delivery;
+  size_t _compress_min_size;
+  std::vector<std::string> _compress_topic_prefixes;
+  bool _decompress;
+  bool _track_operation_memory;
+  OperationMemory _subscribe_memory = {};
+  OperationMemory _publish_memory = {};
+  OperationMemory _dispatch_memory = {};
+  OperationMemory _connect_memory = {};
+  // Recently published messages also delivered locally, to drop their echo from the broker.
+  std::array<LocalEcho, 16> _local_echoes = {};
+  size_t _next_local_echo = 0;
   unsigned long _last_connection_attempt_timestamp_ms = 0;
+  uint32_t _keep_alive_s;
+  uint32_t _keep_alive_max_s;
+  uint32_t _keep_alive_working_s;
+  uint32_t _keep_alive_failed_s = 0;
+  unsigned long _keep_alive_failed_at_ms = 0;
+  // Connections lost while idle in a row, at an interval longer than _keep_alive_working_s.
+  uint32_t _keep_alive_idle_failures = 0;
+  // When anything was last sent, or connected, to estimate the number of pings.
+  unsigned long _last_sent_ms = 0;
+  uint32_t _pings = 0;
+  uint32_t _connection_pings = 0;
 };
 
 #endif // __MQTT_REMOTE_H__
\ No newline at end of file
@@ -0,0 +1,114 @@
+#ifndef __MQTT_RPC_H__
+#define __MQTT_RPC_H__
+
+#include "IMQTTRemote.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Request/response (RPC) on top of MQTTRemote (or any other IMQTTRemote), with correlation IDs and timeouts.
+ *
+ * Both sides use a MQTTRpc. The caller uses call() and the callee uses serve(). The correlation ID is carried in the
+ * topics, so the payloads are left as is:
+ * - Requests are published on "<topic>/<caller client ID>/<correlation ID>".
+ * - Responses are published on "<caller client ID>/rpc/<correlation ID>".
+ *
+ * All responses are received on one shared wildcard subscription, "<client ID>/rpc/+". Outstanding calls are kept
+ * in a fixed size table, so many calls can be in flight at the same time without any allocation per call for the
+ * table itself.
+ *
+ * Wildcard subscriptions must be supported by the IMQTTRemote, which they are by MQTTRemote.
+ */
+class MQTTRpc {
+public:
+  enum class Result : uint8_t {
+    Ok,
+    Timeout,
+  };
+
+  /**
+   * Callback with the result of a call. response is only set if result is Result::Ok. latency_us is the time from
+   * the call until the response was received (or the call timed out).
+   */
+  typedef std::function<void(Result result, const std::string &response, uint32_t latency_us)> ResponseCallback;
+
+  /**
+   * Handler for incoming requests, see serve(). Returns the response to send back.
+   */
+  typedef std::function<std::string(const std::string &request)> RequestHandler;
+
+  struct Stats {
+    // Number of calls made (request published), that got a response and that timed out.
+    uint32_t calls;
+    uint32_t responses;
+    uint32_t timeouts;
+    // Number of calls rejected as all outstanding call slots were taken.
+    uint32_t rejected;
+    // Latency for calls that got a response, in microseconds.
+    uint32_t latency_min_us;
+    uint32_t latency_max_us;
+    uint64_t latency_total_us;
+  };
+
+  /**
+   * @param remote the MQTTRemote (or any other IMQTTRemote) to use.
+   * @param max_outstanding_calls maximum number of calls waiting for a response at the same time.
+   */
+  MQTTRpc(IMQTTRemote &remote, size_t max_outstanding_calls = 16);
+
+  ~MQTTRpc();
+
+  /**
+   * @brief Make a call. The callback is invoked once, either with the response or on timeout.
+   * The callback will be invoked from MQTTRemote::handle() on response, and from handle() on timeout.
+   *
+   * @param topic the topic the callee serves, see serve().
+   * @param payload the request payload.
+   * @param timeout_ms time to wait for a response.
+   * @param callback invoked with the result.
+   * @return false if all outstanding call slots are taken or if the request could not be published. The callback
+   * will not be invoked in this case.
+   */
+  bool call(const std::string &topic, const std::string &payload, uint32_t timeout_ms, ResponseCallback callback);
+
+  /**
+   * @brief Serve calls on topic. The handler is invoked for each request and the returned string is sent back as
+   * the response. Don't do heavy operations in the handler.
+   */
+  bool serve(const std::string &topic, RequestHandler handler);
+
+  /**
+   * @brief Time out calls without response. Call periodically, from Arduino loop() function in main.
+   */
+  void handle();
+
+  /**
+   * @brief returns call statistics.
+   */
+  Stats stats();
+
+private:
+  struct Call {
+    bool active;
+    uint32_t id;
+    unsigned long started_us;
+    // The timeout is checked in milliseconds, as micros() wraps after about 71 minutes.
+    unsigned long started_ms;
+    uint32_t timeout_ms;
+    ResponseCallback callback;
+  };
+
+  void onResponse(const std::string &topic, const std::string &message);
+
+private:
+  IMQTTRemote &_remote;
+  std::string _response_topic_prefix;
+  IMQTTRemote::SubscriptionHandle _response_subscription = 0;
+  std::vector<Call> _calls;
+  uint32_t _next_sequence = 0;
+  Stats _stats = {};
+};
+
+#endif // __MQTT_RPC_H__